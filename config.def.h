@@ -31,6 +31,23 @@ static char vtiden[] = "\033[?6c";
 float cwscale = 1.0;
 float chscale = 1.0;
 
+/*
+ * Runes whose fallback fonts are looked up at startup, one per script
+ * likely to show up, so their first use does not draw placeholders.
+ */
+Rune fallbackwarm[] = {
+	0x4E00,  /* CJK */
+	0xAC00,  /* Hangul */
+	0x2603,  /* symbols */
+	0x1F600, /* emoji */
+};
+
+/*
+ * Memory in MiB the fallback fonts may take, their glyph atlases mostly.
+ * Fonts not drawn for longest are dropped beyond it.
+ */
+unsigned int fallbackmem = 256;
+
 /*
  * word delimiter string
  *
@@ -55,6 +72,12 @@ unsigned int actionfps = 30;
  */
 unsigned int blinktimeout = 800;
 
+/*
+ * milliseconds the terminal size has to stay the same before the program
+ * in it is told, so a drag does not flood it with SIGWINCH
+ */
+unsigned int resizetimeout = 100;
+
 /*
  * thickness of underline and bar cursors
  */
@@ -16,13 +16,17 @@ INCS = -I$(X11INC) \
        `pkg-config --cflags fontconfig` \
        `pkg-config --cflags gl` \
        `pkg-config --cflags freetype2`
-LIBS = -L$(X11LIB) -lm -lrt -lX11 -lutil -lXft -ldl \
+LIBS = -L$(X11LIB) -lm -lrt -lX11 -lutil -lXft -ldl -lpthread \
        `pkg-config --libs fontconfig` \
        `pkg-config --libs gl` \
        `pkg-config --libs freetype2`
 
+# effects: 1 for the fire particles and the keypress jounce, 0 for a
+# renderer that only draws text
+EFFECTS = 1
+
 # flags
-CPPFLAGS = -DVERSION=\"$(VERSION)\" -D_XOPEN_SOURCE=600
+CPPFLAGS = -DVERSION=\"$(VERSION)\" -D_XOPEN_SOURCE=600 -DEFFECTS=$(EFFECTS)
 STDCXXFLAGS = $(CXXFLAGS) $(INCS) $(CPPFLAGS) -std=c++17
 STCFLAGS = $(INCS) $(CPPFLAGS) $(CFLAGS)
 STLDFLAGS = $(LIBS) $(LDFLAGS)
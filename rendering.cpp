@@ -2,6 +2,8 @@
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <glm/glm.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtx/transform.hpp>
@@ -15,14 +17,20 @@
 #include "rendering.h"
 
 #include <cstddef>
+#include <cstring>
 #include <cassert>
 #include <glad/glad.h>
+#include <algorithm>
 #include <memory>
 #include <string>
 #include <unordered_map>
 #include <vector>
-#include <functional>
+#include <chrono>
 #include <cmath>
+#include <type_traits>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include <glm/glm.hpp>
 
 #include FT_BITMAP_H
@@ -38,19 +46,68 @@ extern int font_size;
 #define ROTATION_MAX 0.00314 // About 0.1% of pi
 #define KEYPRESS_TIMEOUT 0.5f
 
+// Effects advance in fixed steps of ANIMATION_STEP seconds, each one
+// ANIMATION_UNIT of effect time. They were tuned at 0.16 per frame at 120
+// frames a second
+#define ANIMATION_STEP (1.f / 120.f)
+#define ANIMATION_UNIT 0.16f
+// Steps simulated per frame at most, particles only age for the rest
+#define ANIMATION_MAX_STEPS 30
+
+// Frames over the frame budget before effects get cheaper, and frames well
+// under it before they get better again
+#define GOVERNOR_DOWN_FRAMES 20
+#define GOVERNOR_UP_FRAMES 240
+// Timer queries in flight, results are read a few frames late
+#define GOVERNOR_QUERIES 4
+
+// Build the fire particles and the keypress jounce, see config.mk
+#ifndef EFFECTS
+#define EFFECTS 1
+#endif
+
 // Technical parameters
 #define ATLAS_SIZE 4096
+// Glyphs below this index are looked up in a flat table, fonts tend to put
+// ASCII and Latin there
+#define ATLAS_DENSE_GLYPHS 1024
+
+// Render targets are allocated in steps of this many pixels, and this many
+// released ones are kept for the next resize
+#define RENDER_TARGET_BUCKET 256
+#define RENDER_TARGET_SPARE 2
 
 #define PARTICLE_FB_SCALE 3
+// Particles the GPU simulation keeps, the oldest are replaced beyond that
+#define PARTICLE_CAPACITY 32768
+#define PARTICLE_GROUP_SIZE 256
+// Particles a dirty glyph asks for, and how many are spawned per frame at
+// most. Beyond the budget every source gets its share
+#define PARTICLES_PER_GLYPH 512
+#define PARTICLE_BUDGET 2048
 
 #define POSITION_LOCATION 0
 #define COLOR_LOCATION 1
 #define UV_LOCATION 2
+#define CELL_LOCATION 3
+
+#define PALETTE_BINDING 0
+#define CELL_GRID_BINDING 1
+#define PARTICLE_BINDING 0
 
 #define TEXTURE_BINDING 0
 
 #define TRANSFORM_LOCATION 0
 #define TEXTURE_LOCATION 1
+#define METRICS_LOCATION 2
+#define PARTICLE_DT_LOCATION 1
+#define PARTICLE_COUNT_LOCATION 2
+#define PARTICLE_MOVE_LOCATION 3
+
+// Set in the mode of cell vertices that take the background colour
+#define CELL_BG_BIT (1u << 16)
+// Set in the mode of grid cells that no row was drawn to
+#define CELL_EMPTY_BIT (1u << 17)
 
 static const char * vert_shader =
   "#version 450\n"
@@ -112,6 +169,124 @@ static const char * color_shader =
   "  color.a = 1.f;\n"
   "}\n";
 
+// Resolves the colours of a cell like st used to on the CPU. Prepended to
+// the cell shaders by cell_shader_source, along with the constants it uses
+static const char * cell_resolve_shader =
+  "layout(std140, binding=PALETTE_BINDING) uniform palette_block {\n"
+  "  vec4 palette[PALETTE_SIZE];\n"
+  "  uint defaultfg;\n"
+  "  uint defaultbg;\n"
+  "  uint modes;\n"
+  "};\n"
+  "vec3 to_linear(vec3 c) {\n"
+  "  return mix(c / 12.92, pow((c + 0.055) / 1.055, vec3(2.4)),\n"
+  "             greaterThanEqual(c, vec3(0.04045)));\n"
+  "}\n"
+  "vec3 to_srgb(vec3 c) {\n"
+  "  return mix(c * 12.92, 1.055 * pow(c, vec3(1.0 / 2.4)) - 0.055,\n"
+  "             greaterThanEqual(c, vec3(0.0031308)));\n"
+  "}\n"
+  "vec4 lookup(uint c) {\n"
+  "  if ((c & TRUECOLOR_BIT) != 0u)\n"
+  "    return vec4(to_linear(vec3(uvec3(c >> 16, c >> 8, c) & 0xffu) / 255.0), 1.0);\n"
+  "  return palette[min(c, uint(PALETTE_SIZE - 1))];\n"
+  "}\n"
+  "vec4 invert(vec4 c) {\n"
+  "  return vec4(to_linear(1.0 - to_srgb(c.rgb)), c.a);\n"
+  "}\n"
+  "void resolve(uvec3 cell, out vec4 fg, out vec4 bg) {\n"
+  "  uint fgi = cell.x, bgi = cell.y, mode = cell.z;\n"
+  // Change basic system colors [0-7] to bright system colors [8-15]
+  "  if ((mode & ATTR_BOLD_FAINT) == ATTR_BOLD && fgi < 8u)\n"
+  "    fgi += 8u;\n"
+  "  vec4 tmp;\n"
+  "  fg = lookup(fgi);\n"
+  "  bg = lookup(bgi);\n"
+  "  if ((modes & RENDER_REVERSE) != 0u) {\n"
+  "    fg = (fgi == defaultfg) ? palette[defaultbg] : invert(fg);\n"
+  "    bg = (bgi == defaultbg) ? palette[defaultfg] : invert(bg);\n"
+  "  }\n"
+  "  if ((mode & ATTR_REVERSE) != 0u) {\n"
+  "    tmp = fg;\n"
+  "    fg = bg;\n"
+  "    bg = tmp;\n"
+  "  }\n"
+  "  if ((mode & ATTR_BOLD_FAINT) == ATTR_FAINT)\n"
+  "    fg.rgb = to_linear(to_srgb(fg.rgb) / 2.0);\n"
+  "  if ((mode & ATTR_BLINK) != 0u && (modes & RENDER_BLINK) != 0u)\n"
+  "    fg = bg;\n"
+  "  if ((mode & ATTR_INVISIBLE) != 0u)\n"
+  "    fg = bg;\n"
+  "}\n";
+
+static const char * cell_vert_shader =
+  "layout(location=0) in vec3 position;\n"
+  "layout(location=2) in vec2 in_uv;\n"
+  "layout(location=3) in uvec3 in_cell;\n"
+  "layout(location=0) uniform mat4 transform;\n"
+  "out vec2 cross_uv;\n"
+  "out vec4 cross_color;\n"
+  "void main() {\n"
+  "  vec4 fg, bg;\n"
+  "  resolve(in_cell, fg, bg);\n"
+  "  gl_Position = transform * vec4(position, 1);\n"
+  "  cross_uv = in_uv;\n"
+  "  cross_color = ((in_cell.z & CELL_BG_BIT) != 0u) ? bg : fg;\n"
+  "}\n";
+
+// Paints the backgrounds and decoration lines of a whole screen from its
+// cell texture. cross_uv is the offset into the grid in pixels
+static const char * cell_grid_frag_shader =
+  "out vec4 color;\n"
+  "in vec4 cross_color;\n"
+  "in vec2 cross_uv;\n"
+  "layout(binding=CELL_GRID_BINDING) uniform usampler2D cells;\n"
+  // cell width and height, underline and strikethrough line in a cell
+  "layout(location=2) uniform ivec4 metrics;\n"
+  "void main() {\n"
+  "  ivec2 p = ivec2(floor(cross_uv));\n"
+  "  ivec2 cell = min(p / metrics.xy, textureSize(cells, 0) - 1);\n"
+  "  int line = p.y - cell.y * metrics.y;\n"
+  "  uvec3 c = texelFetch(cells, cell, 0).xyz;\n"
+  "  if ((c.z & CELL_EMPTY_BIT) != 0u)\n"
+  "    discard;\n"
+  "  vec4 fg, bg;\n"
+  "  resolve(c, fg, bg);\n"
+  "  bool under = (c.z & ATTR_UNDERLINE) != 0u && line == metrics.z;\n"
+  "  bool struck = (c.z & ATTR_STRUCK) != 0u && line == metrics.w;\n"
+  "  color = (under || struck) ? fg : bg;\n"
+  "  color.a = 1.f;\n"
+  "}\n";
+
+/** Prepends the version, the constants shared with st and the colour
+ * resolution to a cell shader */
+static std::string cell_shader_source(const char * body) {
+  std::string src = "#version 450\n";
+  auto define = [&src](const char * name, const std::string & value) {
+    src += std::string("#define ") + name + " " + value + "\n";
+  };
+  auto define_bits = [&define](const char * name, unsigned int value) {
+    define(name, std::to_string(value) + "u");
+  };
+  define("PALETTE_SIZE", std::to_string(RENDER_PALETTE_SIZE));
+  define("PALETTE_BINDING", std::to_string(PALETTE_BINDING));
+  define("CELL_GRID_BINDING", std::to_string(CELL_GRID_BINDING));
+  define_bits("TRUECOLOR_BIT", 1u << 24);
+  define_bits("CELL_BG_BIT", CELL_BG_BIT);
+  define_bits("CELL_EMPTY_BIT", CELL_EMPTY_BIT);
+  define_bits("RENDER_REVERSE", RENDER_REVERSE);
+  define_bits("RENDER_BLINK", RENDER_BLINK);
+  define_bits("ATTR_BOLD", ATTR_BOLD);
+  define_bits("ATTR_FAINT", ATTR_FAINT);
+  define_bits("ATTR_BOLD_FAINT", ATTR_BOLD_FAINT);
+  define_bits("ATTR_UNDERLINE", ATTR_UNDERLINE);
+  define_bits("ATTR_BLINK", ATTR_BLINK);
+  define_bits("ATTR_REVERSE", ATTR_REVERSE);
+  define_bits("ATTR_INVISIBLE", ATTR_INVISIBLE);
+  define_bits("ATTR_STRUCK", ATTR_STRUCK);
+  return src + cell_resolve_shader + body;
+}
+
 struct __attribute__((packed)) vec2 {
   float x, y;
 };
@@ -129,6 +304,15 @@ struct __attribute__((packed)) vertex {
   struct color c;
 };
 
+/** Vertex of cell geometry, coloured by cell_vert_shader */
+struct __attribute__((packed)) cell_vertex {
+  struct __attribute__((packed)) {
+    float x, y, z;
+  } pos;
+  struct vec2 texcoords;
+  uint32_t fg, bg, mode;
+};
+
 class GlTexture;
 template<typename VertexClass> class GlBuffer;
 template<typename VertexClass> class GlVAO;
@@ -172,14 +356,14 @@ public:
 // GlFrameBuffer
 ////////////////////////////////////////////////////////////////////////////////
 
+/** Colour only, nothing drawn to one is depth tested */
 class GlFrameBuffer {
 private:
   GLuint _id;
   GLsizei _width, _height;
   GLuint _color_id;
-  GLuint _depth_id;
 public:
-  GlFrameBuffer(GLsizei width, GLsizei height, bool linear, GLenum depth_format);
+  GlFrameBuffer(GLsizei width, GLsizei height, bool linear);
   GlFrameBuffer(const GlFrameBuffer & other) = delete;
   GlFrameBuffer(GlFrameBuffer && other);
   GlFrameBuffer & operator=(GlFrameBuffer & other) = delete;
@@ -191,17 +375,16 @@ public:
   void bind(GLenum target) const;
 
   GLuint get_main_color() const { return _color_id; }
+  GLsizei width() const { return _width; }
+  GLsizei height() const { return _height; }
 };
 
-GlFrameBuffer::GlFrameBuffer(GLsizei width, GLsizei height, bool linear, GLenum depth_format)
+GlFrameBuffer::GlFrameBuffer(GLsizei width, GLsizei height, bool linear)
   : _width(width),
     _height(height)
 {
-  GLuint texs[2];
   glCreateFramebuffers(1, &_id);
-  glCreateTextures(GL_TEXTURE_2D, 2, texs);
-  _color_id = texs[0];
-  _depth_id = texs[1];
+  glCreateTextures(GL_TEXTURE_2D, 1, &_color_id);
 
   printf("Creating frame buffer of size %d %d \n", width, height);
 
@@ -211,10 +394,7 @@ GlFrameBuffer::GlFrameBuffer(GLsizei width, GLsizei height, bool linear, GLenum
   glTextureParameteri(_color_id, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
   glTextureParameteri(_color_id, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-  glTextureStorage2D(_depth_id, 1, depth_format, width, height);
-
   glNamedFramebufferTexture(_id, GL_COLOR_ATTACHMENT0, _color_id, 0);
-  glNamedFramebufferTexture(_id, GL_DEPTH_ATTACHMENT, _depth_id, 0);
 
   if (!linear) {
     int p;
@@ -227,8 +407,7 @@ GlFrameBuffer::GlFrameBuffer(GLsizei width, GLsizei height, bool linear, GLenum
 
 GlFrameBuffer::~GlFrameBuffer() {
   glDeleteFramebuffers(1, &_id);
-  GLuint textures[2] = {_color_id, _depth_id};
-  glDeleteTextures(2, textures);
+  glDeleteTextures(1, &_color_id);
 }
 
 void GlFrameBuffer::bind(GLenum target) const {
@@ -243,6 +422,67 @@ void GlFrameBuffer::blit_entirely(GLuint dst) const {
                          GL_LINEAR);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// RenderTargetPool
+////////////////////////////////////////////////////////////////////////////////
+
+/** Framebuffers sized up to whole buckets, so a window dragged around does
+ * not reallocate on every ConfigureNotify. Targets are drawn to from the
+ * bottom left corner and are usually larger than what is drawn */
+class RenderTargetPool {
+private:
+  /** Released targets, the most recent last */
+  std::vector<std::unique_ptr<GlFrameBuffer>> _free;
+
+  static GLsizei bucket(GLsizei size);
+  static bool fits(const GlFrameBuffer & fb, GLsizei width, GLsizei height);
+public:
+  RenderTargetPool() = default;
+  RenderTargetPool(const RenderTargetPool & other) = delete;
+  RenderTargetPool & operator=(const RenderTargetPool & other) = delete;
+
+  /** Makes fb a target of at least width x height, keeping the one it has
+   * if that still fits */
+  void fit(std::unique_ptr<GlFrameBuffer> & fb, GLsizei width, GLsizei height);
+  void release(std::unique_ptr<GlFrameBuffer> fb);
+};
+
+GLsizei RenderTargetPool::bucket(GLsizei size) {
+  return DIVCEIL(std::max(size, 1), RENDER_TARGET_BUCKET) * RENDER_TARGET_BUCKET;
+}
+
+bool RenderTargetPool::fits(const GlFrameBuffer & fb, GLsizei width, GLsizei height) {
+  // Not more than a bucket too large either, a maximized window's targets
+  // should not stay around once it is small again
+  return fb.width() >= width && fb.width() <= bucket(width) + RENDER_TARGET_BUCKET &&
+         fb.height() >= height && fb.height() <= bucket(height) + RENDER_TARGET_BUCKET;
+}
+
+void RenderTargetPool::fit(std::unique_ptr<GlFrameBuffer> & fb, GLsizei width, GLsizei height) {
+  if (fb && fits(*fb, width, height)) {
+    return;
+  }
+  release(std::move(fb));
+  for (auto it = _free.rbegin(); it != _free.rend(); ++it) {
+    if (fits(**it, width, height)) {
+      fb = std::move(*it);
+      _free.erase(std::next(it).base());
+      return;
+    }
+  }
+  fb.reset(new GlFrameBuffer(bucket(width), bucket(height), false));
+}
+
+void RenderTargetPool::release(std::unique_ptr<GlFrameBuffer> fb) {
+  if (!fb) {
+    return;
+  }
+  _free.push_back(std::move(fb));
+  if (_free.size() > RENDER_TARGET_SPARE) {
+    _free.erase(_free.begin());
+  }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // GlBuffer
 ////////////////////////////////////////////////////////////////////////////////
@@ -259,13 +499,26 @@ private:
   size_t _capacities[NUM_BUFFERS];
   /** CPU-side storage for all the information */
   std::vector<T> _storage;
+  /** Elements changed since the last sync. Only valid with a single
+   * buffer, the others would miss the changes */
+  size_t _dirty_begin, _dirty_end;
+
+  void mark(size_t begin, size_t end) {
+    if (_dirty_begin == _dirty_end) {
+      _dirty_begin = begin;
+      _dirty_end = end;
+    } else {
+      _dirty_begin = std::min(_dirty_begin, begin);
+      _dirty_end = std::max(_dirty_end, end);
+    }
+  }
 
   friend GlVAO<T>;
-  template<typename F> friend class ParticleSystem;
 public:
   GlBuffer() {
     glCreateBuffers(NUM_BUFFERS, _ids);
     _buffer = 0;
+    _dirty_begin = _dirty_end = 0;
     _storage.reserve(1); // Make sure there is room for at least 1 element
     for (auto i = 0; i < NUM_BUFFERS; ++i) {
       _capacities[i] = _storage.capacity() * sizeof(T);
@@ -295,21 +548,41 @@ public:
       fprintf(stderr, "Warning: too many elements, not adding to buffer\n");
       return;
     }
+    mark(_storage.size(), _storage.size() + count);
     _storage.insert(_storage.end(), elems, elems + count);
   }
 
+  /** Overwrites count elements from offset on, growing the storage if it
+   * ends before them */
+  void write_elements(size_t offset, const T * elems, size_t count) {
+    if (_storage.size() < offset + count) {
+      _storage.resize(offset + count);
+    }
+    std::copy(elems, elems + count, _storage.begin() + offset);
+    mark(offset, offset + count);
+  }
+
+  /** Uploads the elements changed since the last sync, or all of them if
+   * the buffer has to grow */
   void sync() {
     size_t bsize = _storage.size() * sizeof(T);
     if (_capacities[_buffer] < bsize) {
       _capacities[_buffer] = bsize;
       glNamedBufferData(_ids[_buffer], _capacities[_buffer], NULL, GL_STREAM_DRAW);
+      mark(0, _storage.size());
+    }
+    if (_dirty_begin < _dirty_end) {
+      glNamedBufferSubData(_ids[_buffer], _dirty_begin * sizeof(T),
+                           (_dirty_end - _dirty_begin) * sizeof(T),
+                           _storage.data() + _dirty_begin);
     }
-    glNamedBufferSubData(_ids[_buffer], 0, bsize, _storage.data());
+    _dirty_begin = _dirty_end = 0;
     _buffer = (_buffer + 1) % NUM_BUFFERS;
   }
 
   void clear() {
     _storage.clear();
+    _dirty_begin = _dirty_end = 0;
   }
 
   typename std::vector<T>::size_type num_elems() const {
@@ -321,11 +594,124 @@ public:
 // GlShader
 //////////////////////////////////////////////////////////////////////////////
 
+/** Programs are kept linked under $XDG_CACHE_HOME/stgl, in a file named
+ * after a hash of the driver strings and the shader sources. Another
+ * driver or other sources select another file, a binary the driver still
+ * rejects is compiled again and replaced */
+static struct {
+  int loaded, compiled;
+  double load_ms, compile_ms;
+} program_stats;
+
+static uint64_t program_hash(uint64_t h, const void * data, size_t len) {
+  // FNV-1a
+  const unsigned char * p = (const unsigned char *)data;
+  for (size_t i = 0; i < len; ++i) {
+    h = (h ^ p[i]) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+/** Cache file of the program, empty if programs are not kept */
+static std::string program_cache_path(const GLenum * types, const std::string * srcs, int n) {
+  GLint formats = 0;
+  glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+  if (formats == 0) {
+    return std::string();
+  }
+
+  std::string path;
+  const char * dir = getenv("XDG_CACHE_HOME");
+  if (dir && dir[0] == '/') {
+    path = dir;
+  } else if ((dir = getenv("HOME"))) {
+    path = std::string(dir) + "/.cache";
+  } else {
+    return std::string();
+  }
+
+  uint64_t key = 0xcbf29ce484222325ULL;
+  for (GLenum name : {GL_VENDOR, GL_RENDERER, GL_VERSION}) {
+    const char * str = (const char *)glGetString(name);
+    if (str) {
+      key = program_hash(key, str, strlen(str) + 1);
+    }
+  }
+  for (int i = 0; i < n; ++i) {
+    key = program_hash(key, &types[i], sizeof(types[i]));
+    key = program_hash(key, srcs[i].c_str(), srcs[i].size() + 1);
+  }
+
+  char name[32];
+  snprintf(name, sizeof(name), "/program-%016llx", (unsigned long long)key);
+  return path + "/stgl" + name;
+}
+
+/** Links a program from its cache file, 0 if there is none the driver
+ * takes */
+static GLuint program_load(const std::string & path) {
+  FILE * fp = fopen(path.c_str(), "rb");
+  if (!fp) {
+    return 0;
+  }
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  // The binary format, then the binary
+  std::vector<char> data(std::max(size, 0L));
+  bool ok = size > (long)sizeof(GLenum) && fread(data.data(), size, 1, fp) == 1;
+  fclose(fp);
+  if (!ok) {
+    return 0;
+  }
+
+  GLenum format;
+  memcpy(&format, data.data(), sizeof(format));
+  GLuint prog = glCreateProgram();
+  glProgramBinary(prog, format, data.data() + sizeof(format), size - sizeof(format));
+  int linked;
+  glGetProgramiv(prog, GL_LINK_STATUS, &linked);
+  if (linked != GL_TRUE) {
+    glDeleteProgram(prog);
+    return 0;
+  }
+  return prog;
+}
+
+static void program_save(GLuint prog, const std::string & path) {
+  GLint size = 0;
+  glGetProgramiv(prog, GL_PROGRAM_BINARY_LENGTH, &size);
+  if (size <= 0) {
+    return;
+  }
+  std::vector<char> data(sizeof(GLenum) + size);
+  GLenum format;
+  glGetProgramBinary(prog, size, &size, &format, data.data() + sizeof(format));
+  memcpy(data.data(), &format, sizeof(format));
+
+  // Create $XDG_CACHE_HOME and stgl below it if needed
+  std::string dir = path.substr(0, path.rfind('/'));
+  mkdir(dir.substr(0, dir.rfind('/')).c_str(), 0700);
+  mkdir(dir.c_str(), 0700);
+
+  std::string tmp = path + "." + std::to_string(getpid());
+  FILE * fp = fopen(tmp.c_str(), "wb");
+  if (!fp) {
+    return;
+  }
+  bool ok = fwrite(data.data(), sizeof(format) + size, 1, fp) == 1;
+  if (fclose(fp) != 0 || !ok || rename(tmp.c_str(), path.c_str()) != 0) {
+    unlink(tmp.c_str());
+  }
+}
+
 class GlShader {
 private:
   GLuint _prog_id;
 
   GLuint AllocShader(GLenum shader_type, std::string & src);
+  void Build(const GLenum * types, std::string * srcs, int n);
+  void Link(const GLuint * shaders, int n);
 public:
   /** Creates a new shader
 
@@ -333,6 +719,11 @@ public:
       @param frag the fragment shader
   */
   GlShader(std::string vert, std::string frag);
+  /** Creates a compute shader
+
+      @param comp the compute shader
+  */
+  explicit GlShader(std::string comp);
   GlShader(GlShader & other) = delete;
   GlShader(GlShader && other);
   GlShader & operator=(GlShader & other) = delete;
@@ -341,6 +732,9 @@ public:
 
   void bind(void);
   void uniform(GLint location, GLboolean transpose, const glm::mat4 & m);
+  void uniform(GLint location, GLint x, GLint y, GLint z, GLint w);
+  void uniform(GLint location, GLfloat x);
+  void uniform(GLint location, GLuint x);
 };
 
 static void PrintShaderInfoLog(GLuint shader) {
@@ -371,18 +765,48 @@ GLuint GlShader::AllocShader(GLenum shader_type, std::string & src) {
 }
 
 GlShader::GlShader(std::string vert, std::string frag) {
-  printf("Make vertex shader\n");
-  GLuint vshdr = AllocShader(GL_VERTEX_SHADER, vert);
-  printf("Make fragment shader\n");
-  GLuint fshdr = AllocShader(GL_FRAGMENT_SHADER, frag);
+  GLenum types[] = {GL_VERTEX_SHADER, GL_FRAGMENT_SHADER};
+  std::string srcs[] = {std::move(vert), std::move(frag)};
+  Build(types, srcs, 2);
+}
 
+GlShader::GlShader(std::string comp) {
+  GLenum type = GL_COMPUTE_SHADER;
+  Build(&type, &comp, 1);
+}
+
+void GlShader::Build(const GLenum * types, std::string * srcs, int n) {
+  auto start = std::chrono::steady_clock::now();
+  std::string path = program_cache_path(types, srcs, n);
+  if (!path.empty() && (_prog_id = program_load(path))) {
+    program_stats.loaded++;
+    program_stats.load_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return;
+  }
+
+  std::vector<GLuint> shaders;
+  for (int i = 0; i < n; ++i) {
+    shaders.push_back(AllocShader(types[i], srcs[i]));
+  }
+  Link(shaders.data(), n);
+  if (!path.empty()) {
+    program_save(_prog_id, path);
+  }
+  program_stats.compiled++;
+  program_stats.compile_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+void GlShader::Link(const GLuint * shaders, int n) {
   _prog_id = glCreateProgram();
-  glAttachShader(_prog_id, vshdr);
-  glAttachShader(_prog_id, fshdr);
+  for (int i = 0; i < n; ++i) {
+    glAttachShader(_prog_id, shaders[i]);
+  }
+  glProgramParameteri(_prog_id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
   glLinkProgram(_prog_id);
 
-  glDeleteShader(vshdr);
-  glDeleteShader(fshdr);
+  for (int i = 0; i < n; ++i) {
+    glDeleteShader(shaders[i]);
+  }
 
   int linked;
   glGetProgramiv(_prog_id, GL_LINK_STATUS, &linked);
@@ -413,6 +837,18 @@ void GlShader::uniform(GLint location, GLboolean transpose, const glm::mat4 & ma
   glProgramUniformMatrix4fv(_prog_id, location, 1, transpose, glm::value_ptr(mat));
 }
 
+void GlShader::uniform(GLint location, GLint x, GLint y, GLint z, GLint w) {
+  glProgramUniform4i(_prog_id, location, x, y, z, w);
+}
+
+void GlShader::uniform(GLint location, GLfloat x) {
+  glProgramUniform1f(_prog_id, location, x);
+}
+
+void GlShader::uniform(GLint location, GLuint x) {
+  glProgramUniform1ui(_prog_id, location, x);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // GlVAO
 ////////////////////////////////////////////////////////////////////////////////
@@ -437,6 +873,8 @@ public:
   void bind_attrib(GLuint attrib_index, GLuint buffer_index);
   void enable_attrib(GLuint attrib_index);
   void attrib_format(GLuint attrib_index, GLint size, GLenum type, GLboolean normalized, GLuint relativeOffset);
+  /** Like attrib_format, for attributes read as integers by the shader */
+  void attrib_iformat(GLuint attrib_index, GLint size, GLenum type, GLuint relativeOffset);
   void bind() const;
 };
 
@@ -466,6 +904,11 @@ void GlVAO<V>::attrib_format(GLuint attrib_index, GLint size, GLenum type, GLboo
   glVertexArrayAttribFormat(_id, attrib_index, size, type, normalized, relative_offset);
 }
 
+template<typename V>
+void GlVAO<V>::attrib_iformat(GLuint attrib_index, GLint size, GLenum type, GLuint relative_offset) {
+  glVertexArrayAttribIFormat(_id, attrib_index, size, type, relative_offset);
+}
+
 template<typename V>
 void GlVAO<V>::enable_attrib(GLuint attrib_index) {
   glEnableVertexArrayAttrib(_id, attrib_index);
@@ -477,21 +920,97 @@ void GlVAO<V>::bind() const {
   glBindVertexArray(_id);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Palette
+////////////////////////////////////////////////////////////////////////////////
+
+/** The uniform block cell shaders resolve colours against */
+class Palette {
+private:
+  /** std140 layout of palette_block */
+  struct __attribute__((packed)) block {
+    color colors[RENDER_PALETTE_SIZE];
+    uint32_t defaultfg, defaultbg, modes, pad;
+  };
+
+  GLuint _id;
+  block _block;
+  bool _colors_dirty;
+  bool _modes_dirty;
+public:
+  Palette();
+  Palette(const Palette & other) = delete;
+  Palette & operator=(const Palette & other) = delete;
+  ~Palette();
+
+  void set_colors(const color * colors, int n, uint32_t defaultfg, uint32_t defaultbg);
+  void set_modes(uint32_t modes);
+  /** Uploads whatever changed and binds the block */
+  void bind(GLuint binding);
+};
+
+Palette::Palette()
+  : _block(),
+    _colors_dirty(true),
+    _modes_dirty(false) {
+  glCreateBuffers(1, &_id);
+  glNamedBufferData(_id, sizeof(block), NULL, GL_DYNAMIC_DRAW);
+}
+
+Palette::~Palette() {
+  glDeleteBuffers(1, &_id);
+}
+
+void Palette::set_colors(const color * colors, int n, uint32_t defaultfg, uint32_t defaultbg) {
+  n = std::min(n, RENDER_PALETTE_SIZE);
+  std::copy(colors, colors + n, _block.colors);
+  _block.defaultfg = std::min(defaultfg, (uint32_t)RENDER_PALETTE_SIZE - 1);
+  _block.defaultbg = std::min(defaultbg, (uint32_t)RENDER_PALETTE_SIZE - 1);
+  _colors_dirty = true;
+}
+
+void Palette::set_modes(uint32_t modes) {
+  if (modes != _block.modes) {
+    _block.modes = modes;
+    _modes_dirty = true;
+  }
+}
+
+void Palette::bind(GLuint binding) {
+  if (_colors_dirty) {
+    glNamedBufferSubData(_id, 0, sizeof(block), &_block);
+  } else if (_modes_dirty) {
+    // Blinking flips this every blinktimeout, leave the colours alone
+    glNamedBufferSubData(_id, offsetof(block, modes), sizeof(_block.modes), &_block.modes);
+  }
+  _colors_dirty = _modes_dirty = false;
+  glBindBufferBase(GL_UNIFORM_BUFFER, binding, _id);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Particle system
 ////////////////////////////////////////////////////////////////////////////////
+// One attribute per particle stream, see ParticleStreams
 const char * particle_vert_shader =
   "#version 450\n"
-  "layout(location=0) in vec4 position_life;\n"
-  "layout(location=1) in vec4 in_color;\n"
+  "layout(location=0) in float x;\n"
+  "layout(location=1) in float y;\n"
+  "layout(location=2) in float t;\n"
+  "layout(location=3) in float r;\n"
+  "layout(location=4) in float g;\n"
+  "layout(location=5) in float b;\n"
+  "layout(location=6) in float a;\n"
+  "layout(location=7) in float vx;\n"
+  "layout(location=8) in float vy;\n"
   "layout(location=0) uniform mat4 transform;\n"
+  "layout(location=1) uniform float lead;\n"
   "out float life;\n"
   "out vec4 cross_color;\n"
   "void main() {"
-  "  gl_Position = transform * vec4(position_life.xyz, 1);\n"
+  "  gl_Position = transform * vec4(x + lead * vx, y + lead * vy, 0, 1);\n"
   "  gl_PointSize = 3.f;\n"
-  "  cross_color = in_color;\n"
-  "  life = position_life.w;\n"
+  "  cross_color = vec4(r, g, b, a);\n"
+  "  life = t;\n"
   "}\n";
 
 static const char * particle_frag_shader =
@@ -503,156 +1022,672 @@ static const char * particle_frag_shader =
   "  color = cross_color;\n"
   "}\n";
 
-struct __attribute__((packed)) particle {
-  float x, y, z, t;
-  float vx, vy, vz;
-  struct color c;
+/** Particles as structure of arrays, so updates run over plain float
+ * streams. The streams up to NUM_DRAWN are uploaded for drawing, in the
+ * order of the particle vertex shader attributes. Velocities are drawn
+ * too, to move particles between simulation steps */
+struct ParticleStreams {
+  enum stream { X, Y, T, R, G, B, A, VX, VY, NUM_STREAMS, NUM_DRAWN = NUM_STREAMS };
+
+  std::vector<float> s[NUM_STREAMS];
+
+  size_t size() const { return s[T].size(); }
+  float * operator[](int stream) { return s[stream].data(); }
+};
+
+// Coefficients of flame_curve per colour channel, in Chebyshev polynomials
+static const float flame_r[] = { -7.42828172, 13.49066809, -9.02608052,  3.68452288, -0.71117265 };
+static const float flame_g[] = { -4.56657944, 8.57004895, -6.62752371, 3.5393551, -0.99186063 };
+static const float flame_b[] = { 8.60556488, -14.57317637,  8.7124878, -3.42279269,  0.7211981 };
+
+static inline void flame_curve(float f, float & r, float & g, float & b, float & a) {
+  // t0 = 1
+  // t1 = f
+  float t2 = 2 * f * f - 1;
+  float t3 = f * (2 * t2 - 1); // 2 f t2 -  t1
+  float t4 = 2 * f * t3 - t2;
+
+  r = flame_r[0] + f * flame_r[1] + t2 * flame_r[2] + t3 * flame_r[3] + t4 * flame_r[4];
+  g = flame_g[0] + f * flame_g[1] + t2 * flame_g[2] + t3 * flame_g[3] + t4 * flame_g[4];
+  b = flame_b[0] + f * flame_b[1] + t2 * flame_b[2] + t3 * flame_b[3] + t4 * flame_b[4];
+  a = 1.f - f;
+}
+
+/** Ages particles from begin to end, lets them fall and paints them along
+ * the flame curve */
+static void basic_update_scalar(ParticleStreams & p, size_t begin, size_t end, float dt) {
+  float * x = p[p.X], * y = p[p.Y], * t = p[p.T];
+  float * vx = p[p.VX], * vy = p[p.VY];
+  for (size_t i = begin; i < end; ++i) {
+    t[i] += dt;
+    x[i] += dt * vx[i];
+    y[i] += dt * vy[i];
+    vy[i] += 100.f * dt;
+    flame_curve(t[i], p[p.R][i], p[p.G][i], p[p.B][i], p[p.A][i]);
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PARTICLES_AVX2 1
+
+__attribute__((target("avx2,fma")))
+static inline __m256 flame_channel8(const float * c, __m256 f, __m256 t2, __m256 t3, __m256 t4) {
+  __m256 v = _mm256_fmadd_ps(f, _mm256_set1_ps(c[1]), _mm256_set1_ps(c[0]));
+  v = _mm256_fmadd_ps(t2, _mm256_set1_ps(c[2]), v);
+  v = _mm256_fmadd_ps(t3, _mm256_set1_ps(c[3]), v);
+  return _mm256_fmadd_ps(t4, _mm256_set1_ps(c[4]), v);
+}
 
-  particle(const glm::vec3 & pos, const glm::vec3 & vel, float t, const color & c) {
-    x = pos.x;
-    y = pos.y;
-    z = pos.z;
-    this->t = t;
-    vx = vel.x;
-    vy = vel.y;
-    vz = vel.z;
-    this->c = c;
+/** basic_update_scalar eight particles at a time */
+__attribute__((target("avx2,fma")))
+static size_t basic_update_avx2(ParticleStreams & p, size_t n, float dt) {
+  float * x = p[p.X], * y = p[p.Y], * t = p[p.T];
+  float * vx = p[p.VX], * vy = p[p.VY];
+  const __m256 vdt = _mm256_set1_ps(dt);
+  const __m256 gravity = _mm256_set1_ps(100.f * dt);
+  const __m256 one = _mm256_set1_ps(1.f);
+  const __m256 two = _mm256_set1_ps(2.f);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 f = _mm256_add_ps(_mm256_loadu_ps(t + i), vdt);
+    __m256 vy8 = _mm256_loadu_ps(vy + i);
+    _mm256_storeu_ps(t + i, f);
+    _mm256_storeu_ps(x + i, _mm256_fmadd_ps(vdt, _mm256_loadu_ps(vx + i), _mm256_loadu_ps(x + i)));
+    _mm256_storeu_ps(y + i, _mm256_fmadd_ps(vdt, vy8, _mm256_loadu_ps(y + i)));
+    _mm256_storeu_ps(vy + i, _mm256_add_ps(vy8, gravity));
+
+    __m256 t2 = _mm256_fmsub_ps(_mm256_mul_ps(two, f), f, one);
+    __m256 t3 = _mm256_mul_ps(f, _mm256_fmsub_ps(two, t2, one));
+    __m256 t4 = _mm256_fmsub_ps(_mm256_mul_ps(two, f), t3, t2);
+    _mm256_storeu_ps(p[p.R] + i, flame_channel8(flame_r, f, t2, t3, t4));
+    _mm256_storeu_ps(p[p.G] + i, flame_channel8(flame_g, f, t2, t3, t4));
+    _mm256_storeu_ps(p[p.B] + i, flame_channel8(flame_b, f, t2, t3, t4));
+    _mm256_storeu_ps(p[p.A] + i, _mm256_sub_ps(one, f));
+  }
+  return i;
+}
+#endif
+
+/** The update of the fire particles, with AVX2 where the CPU has it */
+struct BasicUpdate {
+  void operator()(ParticleStreams & p, float dt) const {
+    size_t done = 0;
+#ifdef PARTICLES_AVX2
+    static const bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    if (avx2) {
+      done = basic_update_avx2(p, p.size(), dt);
+    }
+#endif
+    basic_update_scalar(p, done, p.size(), dt);
   }
 };
 
+/** Particles simulated on the CPU. UpdateFunc is called with all streams
+ * once per update, dead particles are compacted away afterwards */
 template<typename UpdateFunc>
 class ParticleSystem {
 private:
-  std::shared_ptr<GlBuffer<particle>> _particles;
-  std::shared_ptr<GlVAO<particle>> _vao;
+  ParticleStreams _streams;
+  /** Indices of the particles compact() keeps */
+  std::vector<uint32_t> _keep;
+  /** Next particle replaced once PARTICLE_CAPACITY are alive */
+  size_t _overwrite;
+  /** Uploaded streams, one after the other */
+  GLuint _buffer;
+  size_t _buffer_cap;
+  GLuint _vao;
   GlShader _shader;
   UpdateFunc _update;
   float _max_age;
+
+  void compact();
 public:
   ParticleSystem(UpdateFunc f, float max_age);
   ParticleSystem(const ParticleSystem & other) = delete;
-  ParticleSystem(const ParticleSystem && other);
-  ParticleSystem & operator=(ParticleSystem & other) = delete;
-  ParticleSystem & operator=(ParticleSystem && other);
+  ParticleSystem & operator=(const ParticleSystem & other) = delete;
   ~ParticleSystem();
 
   void add_particle(const glm::vec3 & pos, const glm::vec3 & vel, float t, const color & c);
   void do_update(float dt);
-  void render(const glm::mat4& t);
+  /** Moves time on by dt without moving the particles */
+  void age(float dt);
+  /** Draws the particles as they are lead after the last update */
+  void render(const glm::mat4& t, float lead);
+  bool alive() const { return _streams.size() > 0; }
 };
 
 template<typename F>
 ParticleSystem<F>::ParticleSystem(F f, float max_age)
-  : _particles(new GlBuffer<particle>()),
-    _vao(new GlVAO<particle>(_particles)),
+  : _overwrite(0),
+    _buffer_cap(0),
     _shader(std::string(particle_vert_shader), std::string(particle_frag_shader)),
     _update(f),
     _max_age(max_age)
 {
-  _vao->enable_attrib(POSITION_LOCATION);
-  _vao->enable_attrib(COLOR_LOCATION);
-
-  _vao->bind_attrib(POSITION_LOCATION, 0);
-  _vao->bind_attrib(COLOR_LOCATION, 0);
-
-  _vao->attrib_format(POSITION_LOCATION, 4, GL_FLOAT, GL_FALSE, offsetof(particle, x));
-  _vao->attrib_format(COLOR_LOCATION, 4, GL_FLOAT, GL_FALSE, offsetof(particle, c));
+  glCreateBuffers(1, &_buffer);
+  glCreateVertexArrays(1, &_vao);
+  for (int i = 0; i < ParticleStreams::NUM_DRAWN; ++i) {
+    glEnableVertexArrayAttrib(_vao, i);
+    glVertexArrayAttribBinding(_vao, i, i);
+    glVertexArrayAttribFormat(_vao, i, 1, GL_FLOAT, GL_FALSE, 0);
+  }
 }
 
 template<typename F>
-ParticleSystem<F>::~ParticleSystem() {}
+ParticleSystem<F>::~ParticleSystem() {
+  glDeleteVertexArrays(1, &_vao);
+  glDeleteBuffers(1, &_buffer);
+}
 
 template<typename F>
 void ParticleSystem<F>::add_particle(const glm::vec3 & pos, const glm::vec3 & vel, float t, const color & c) {
-  particle np(pos, vel, t, c);
-  if (_particles->_storage.size() > 32192) {
-    int ridx = rand() % 32192;
-    _particles->_storage[ridx] = np;
+  const float values[ParticleStreams::NUM_STREAMS] = {
+    pos.x, pos.y, t, c.r, c.g, c.b, c.a, vel.x, vel.y
+  };
+  if (_streams.size() >= PARTICLE_CAPACITY) {
+    // Compaction keeps the order, so this walks over the oldest first
+    for (int i = 0; i < ParticleStreams::NUM_STREAMS; ++i) {
+      _streams.s[i][_overwrite] = values[i];
+    }
+    _overwrite = (_overwrite + 1) % PARTICLE_CAPACITY;
   } else {
-    _particles->_storage.push_back(np);
+    for (int i = 0; i < ParticleStreams::NUM_STREAMS; ++i) {
+      _streams.s[i].push_back(values[i]);
+    }
+  }
+}
+
+template<typename F>
+void ParticleSystem<F>::compact() {
+  // Find the live particles once, then move every stream down in order
+  const float * t = _streams[ParticleStreams::T];
+  size_t n = _streams.size();
+  _keep.clear();
+  for (size_t i = 0; i < n; ++i) {
+    if (t[i] <= 1.f) {
+      _keep.push_back(i);
+    }
+  }
+  size_t live = _keep.size();
+  if (live == n) {
+    return;
+  }
+  for (auto & stream : _streams.s) {
+    for (size_t i = 0; i < live; ++i) {
+      stream[i] = stream[_keep[i]];
+    }
+    stream.resize(live);
   }
 }
 
 template<typename F>
 void ParticleSystem<F>::do_update(float dt) {
+  if (_streams.size() == 0) {
+    return;
+  }
+  _update(_streams, dt / _max_age);
+  compact();
+}
+
+template<typename F>
+void ParticleSystem<F>::age(float dt) {
+  float * t = _streams[ParticleStreams::T];
+  size_t n = _streams.size();
   dt /= _max_age;
-  auto & store = _particles->_storage;
-  for (auto i = 0ul; i < store.size(); i++) {
-    _update(store[i], dt);
-    if (store[i].t > 1.f) {
-      store[i] = store[store.size() - 1];
-      store.pop_back();
-    }
+  for (size_t i = 0; i < n; ++i) {
+    t[i] += dt;
   }
+  compact();
 }
 
 template<typename F>
-void ParticleSystem<F>::render(const glm::mat4 & transform) {
-  if (_particles->num_elems() == 0) {
+void ParticleSystem<F>::render(const glm::mat4 & transform, float lead) {
+  size_t n = _streams.size();
+  if (n == 0) {
     return;
   }
-  _vao->bind_buffer(_particles, 0, 0, sizeof(particle));
+  size_t stride = n * sizeof(float);
+  if (_buffer_cap < ParticleStreams::NUM_DRAWN * stride) {
+    _buffer_cap = ParticleStreams::NUM_DRAWN * stride;
+    glNamedBufferData(_buffer, _buffer_cap, NULL, GL_STREAM_DRAW);
+  }
+  for (int i = 0; i < ParticleStreams::NUM_DRAWN; ++i) {
+    glNamedBufferSubData(_buffer, i * stride, stride, _streams[i]);
+    glVertexArrayVertexBuffer(_vao, i, _buffer, i * stride, sizeof(float));
+  }
 
-  _particles->sync();
   _shader.bind();
-  _vao->bind();
+  glBindVertexArray(_vao);
   _shader.uniform(TRANSFORM_LOCATION, GL_TRUE, transform);
+  _shader.uniform(1, lead / _max_age);
 
-  glDrawArrays(GL_POINTS, 0, _particles->num_elems());
+  glDrawArrays(GL_POINTS, 0, n);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-// atlas
+// GPU particle system
 ////////////////////////////////////////////////////////////////////////////////
 
-struct glyph_render_params{
-  struct rect uvs;
-  struct vec2 offset;
+// basic_update, run on every live particle
+static const char * particle_update_shader =
+  "layout(local_size_x=PARTICLE_GROUP_SIZE) in;\n"
+  "layout(std430, binding=PARTICLE_BINDING) buffer particle_block {\n"
+  "  particle parts[];\n"
+  "};\n"
+  "layout(location=PARTICLE_DT_LOCATION) uniform float dt;\n"
+  "layout(location=PARTICLE_COUNT_LOCATION) uniform uint count;\n"
+  // 0 only ages the particles, see GpuParticleSystem::age()
+  "layout(location=PARTICLE_MOVE_LOCATION) uniform float move;\n"
+  "void main() {\n"
+  "  uint i = gl_GlobalInvocationID.x;\n"
+  "  if (i >= count || parts[i].pos_t.w > 1.0) {\n"
+  "    return;\n"
+  "  }\n"
+  "  particle p = parts[i];\n"
+  "  p.pos_t.w += dt;\n"
+  "  p.pos_t.xy += move * dt * p.vel.xy;\n"
+  "  p.vel.y += move * 100.0 * dt;\n"
+  "  parts[i] = p;\n"
+  "}\n";
+
+// Reads the particle of the vertex straight from the simulation buffer and
+// colours it along flame_curve
+static const char * gpu_particle_vert_shader =
+  "layout(std430, binding=PARTICLE_BINDING) readonly buffer particle_block {\n"
+  "  particle parts[];\n"
+  "};\n"
+  "layout(location=0) uniform mat4 transform;\n"
+  "layout(location=PARTICLE_DT_LOCATION) uniform float lead;\n"
+  "out vec4 cross_color;\n"
+  "vec4 flame_curve(float f) {\n"
+  "  float t2 = 2.0 * f * f - 1.0;\n"
+  "  float t3 = f * (2.0 * t2 - 1.0);\n"
+  "  float t4 = 2.0 * f * t3 - t2;\n"
+  "  vec3 c = vec3(-7.42828172, -4.56657944, 8.60556488)\n"
+  "    + f * vec3(13.49066809, 8.57004895, -14.57317637)\n"
+  "    + t2 * vec3(-9.02608052, -6.62752371, 8.7124878)\n"
+  "    + t3 * vec3(3.68452288, 3.5393551, -3.42279269)\n"
+  "    + t4 * vec3(-0.71117265, -0.99186063, 0.7211981);\n"
+  "  return vec4(c, 1.0 - f);\n"
+  "}\n"
+  "void main() {\n"
+  "  vec4 p = parts[gl_VertexID].pos_t;\n"
+  "  gl_PointSize = 3.f;\n"
+  "  cross_color = flame_curve(p.w);\n"
+  // Dead particles are put outside the clip volume, which drops them.
+  // Live ones are moved on by the time since the last step
+  "  p.xy += lead * parts[gl_VertexID].vel.xy;\n"
+  "  gl_Position = p.w > 1.0 ? vec4(2.0, 2.0, 2.0, 1.0)\n"
+  "                          : transform * vec4(p.xyz, 1);\n"
+  "}\n";
+
+/** Prepends the version, the constants and the particle struct to body */
+static std::string particle_shader_source(const char * body) {
+  std::string src = "#version 450\n";
+  auto define = [&src](const char * name, int value) {
+    src += std::string("#define ") + name + " " + std::to_string(value) + "\n";
+  };
+  define("PARTICLE_GROUP_SIZE", PARTICLE_GROUP_SIZE);
+  define("PARTICLE_BINDING", PARTICLE_BINDING);
+  define("PARTICLE_DT_LOCATION", PARTICLE_DT_LOCATION);
+  define("PARTICLE_COUNT_LOCATION", PARTICLE_COUNT_LOCATION);
+  define("PARTICLE_MOVE_LOCATION", PARTICLE_MOVE_LOCATION);
+  src +=
+    "struct particle {\n"
+    "  vec4 pos_t;\n"
+    "  vec4 vel;\n"
+    "};\n";
+  return src + body;
+}
+
+/** A particle as the GPU simulation stores it, std430 */
+struct gpu_particle {
+  float x, y, z, t;
+  float vx, vy, vz, pad;
 };
 
-struct atlas {
-  GlTexture tex;
-  FT_Face face;
-  std::unordered_map<FT_UInt, struct glyph_render_params> uvs;
-  unsigned int cx, cy, rowmax;
+/** Particles that live in a GPU buffer. The CPU only writes new particles,
+ * integration and colouring run in a compute and a vertex shader */
+class GpuParticleSystem {
+private:
+  /** Ring of PARTICLE_CAPACITY particles, new ones replace the oldest */
+  GLuint _particles;
+  /** Staging for the particles spawned since the last update */
+  GLuint _spawn_buf;
+  size_t _spawn_cap;
+  std::vector<gpu_particle> _spawns;
+  /** Shaders read the particles from _particles, this has no attributes */
+  GLuint _vao;
+  GlShader _update;
+  GlShader _shader;
+  float _max_age;
+  /** Next slot of the ring to write, and how many slots were written */
+  size_t _head;
+  size_t _used;
+  /** Time since the last spawn, in lifetimes. Beyond 1 all are dead */
+  float _idle;
+public:
+  GpuParticleSystem(float max_age);
+  GpuParticleSystem(const GpuParticleSystem & other) = delete;
+  GpuParticleSystem & operator=(const GpuParticleSystem & other) = delete;
+  ~GpuParticleSystem();
 
-  atlas(FT_Face my_face):
-    tex(),
-    face(my_face) {
-    glBindTexture(GL_TEXTURE_2D, tex.GetID());
-    glTexStorage2D(GL_TEXTURE_2D, 1, GL_R8, ATLAS_SIZE, ATLAS_SIZE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    cx = 0;
-    cy = 0;
-    rowmax = 0;
-  }
+  void add_particle(const glm::vec3 & pos, const glm::vec3 & vel, float t, const color & c);
+  void do_update(float dt);
+  /** Moves time on by dt without moving the particles */
+  void age(float dt);
+  /** Draws the particles as they are lead after the last update */
+  void render(const glm::mat4& t, float lead);
+  bool alive() const { return _used > 0; }
+};
 
-  void glyph_render_params(FT_UInt glyph, struct glyph_render_params & out) {
-    auto kv = uvs.find(glyph);
-    if (kv != uvs.end()) {
-      out = kv->second;
-      return;
-    }
-    // render the glyph
-    int error;
-    if ((error = FT_Load_Glyph(face, glyph, FT_LOAD_DEFAULT)) != 0) {
-      die("Failed to load glyph %d %d\n", glyph, error);
-    }
-    if ((error = FT_Render_Glyph(face->glyph, FT_RENDER_MODE_NORMAL)) != 0) {
-      die("Failed to render glyph %d %d\n", glyph, error);
+GpuParticleSystem::GpuParticleSystem(float max_age)
+  : _spawn_cap(0),
+    _update(particle_shader_source(particle_update_shader)),
+    _shader(particle_shader_source(gpu_particle_vert_shader), std::string(particle_frag_shader)),
+    _max_age(max_age),
+    _head(0),
+    _used(0),
+    _idle(2.f) {
+  glCreateBuffers(1, &_particles);
+  glNamedBufferStorage(_particles, PARTICLE_CAPACITY * sizeof(gpu_particle), NULL, 0);
+  glCreateBuffers(1, &_spawn_buf);
+  glCreateVertexArrays(1, &_vao);
+}
+
+GpuParticleSystem::~GpuParticleSystem() {
+  glDeleteVertexArrays(1, &_vao);
+  glDeleteBuffers(1, &_spawn_buf);
+  glDeleteBuffers(1, &_particles);
+}
+
+void GpuParticleSystem::add_particle(const glm::vec3 & pos, const glm::vec3 & vel, float t, const color & c) {
+  // The colour only depends on the age, the vertex shader works it out
+  (void) c;
+  _spawns.push_back({pos.x, pos.y, pos.z, t, vel.x, vel.y, vel.z, 0.f});
+}
+
+void GpuParticleSystem::do_update(float dt) {
+  dt /= _max_age;
+
+  if (!_spawns.empty()) {
+    // Only the newest PARTICLE_CAPACITY would survive the ring anyway
+    size_t n = std::min(_spawns.size(), (size_t)PARTICLE_CAPACITY);
+    const gpu_particle * first = _spawns.data() + _spawns.size() - n;
+    if (_spawn_cap < n) {
+      _spawn_cap = std::max(n, 2 * _spawn_cap);
+      glNamedBufferData(_spawn_buf, _spawn_cap * sizeof(gpu_particle), NULL, GL_STREAM_DRAW);
     }
-    FT_Bitmap * bm = &face->glyph->bitmap;
-    if (cx + bm->width >= ATLAS_SIZE) {
-      cx = 0;
-      cy += rowmax + 1;
-      if (cy >= ATLAS_SIZE) {
-        die("Ran out of space in atlas!\n");
-      }
-      rowmax = 0;
+    glNamedBufferSubData(_spawn_buf, 0, n * sizeof(gpu_particle), first);
+
+    // Copy into the ring, in two parts when it wraps around
+    size_t tail = std::min(n, PARTICLE_CAPACITY - _head);
+    glCopyNamedBufferSubData(_spawn_buf, _particles, 0,
+                             _head * sizeof(gpu_particle), tail * sizeof(gpu_particle));
+    if (tail < n) {
+      glCopyNamedBufferSubData(_spawn_buf, _particles, tail * sizeof(gpu_particle),
+                               0, (n - tail) * sizeof(gpu_particle));
     }
-    if (bm->rows > rowmax) {
-      rowmax = bm->rows;
+    _head = (_head + n) % PARTICLE_CAPACITY;
+    _used = std::min(_used + n, (size_t)PARTICLE_CAPACITY);
+    _spawns.clear();
+    _idle = 0.f;
+  }
+
+  if (_idle > 1.f) {
+    _head = _used = 0;
+    return;
+  }
+  _idle += dt;
+
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, PARTICLE_BINDING, _particles);
+  _update.bind();
+  _update.uniform(PARTICLE_DT_LOCATION, dt);
+  _update.uniform(PARTICLE_COUNT_LOCATION, (GLuint)_used);
+  _update.uniform(PARTICLE_MOVE_LOCATION, 1.f);
+  glDispatchCompute((_used + PARTICLE_GROUP_SIZE - 1) / PARTICLE_GROUP_SIZE, 1, 1);
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+}
+
+void GpuParticleSystem::age(float dt) {
+  dt /= _max_age;
+  _idle += dt;
+  if (_idle > 1.f) {
+    _head = _used = 0;
+    return;
+  }
+
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, PARTICLE_BINDING, _particles);
+  _update.bind();
+  _update.uniform(PARTICLE_DT_LOCATION, dt);
+  _update.uniform(PARTICLE_COUNT_LOCATION, (GLuint)_used);
+  _update.uniform(PARTICLE_MOVE_LOCATION, 0.f);
+  glDispatchCompute((_used + PARTICLE_GROUP_SIZE - 1) / PARTICLE_GROUP_SIZE, 1, 1);
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+}
+
+void GpuParticleSystem::render(const glm::mat4 & transform, float lead) {
+  if (_used == 0) {
+    return;
+  }
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, PARTICLE_BINDING, _particles);
+  _shader.bind();
+  glBindVertexArray(_vao);
+  _shader.uniform(TRANSFORM_LOCATION, GL_TRUE, transform);
+  _shader.uniform(PARTICLE_DT_LOCATION, lead / _max_age);
+
+  glDrawArrays(GL_POINTS, 0, _used);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Particle emitter
+////////////////////////////////////////////////////////////////////////////////
+
+/** Eight interleaved xorshift32 generators, so filling runs lane-parallel */
+class Xorshift8 {
+private:
+  uint32_t _s[8];
+public:
+  Xorshift8(uint32_t seed);
+
+  /** Writes n uniform floats in [0, 1), n a multiple of 8 */
+  void fill(float * out, size_t n);
+};
+
+Xorshift8::Xorshift8(uint32_t seed) {
+  for (auto & s : _s) {
+    // Spread the seed over the lanes, xorshift must not start at 0
+    seed = seed * 747796405u + 2891336453u;
+    s = seed | 1;
+  }
+}
+
+void Xorshift8::fill(float * out, size_t n) {
+  for (size_t i = 0; i < n; i += 8) {
+    for (int l = 0; l < 8; ++l) {
+      uint32_t x = _s[l];
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      _s[l] = x;
+      // 23 random mantissa bits make a float in [1, 2)
+      uint32_t bits = (x >> 9) | 0x3f800000u;
+      float f;
+      memcpy(&f, &bits, sizeof(f));
+      out[i + l] = f - 1.f;
+    }
+  }
+}
+
+/** Collects where dirty glyphs ask for particles over a frame, and spawns
+ * at most the budget, PARTICLE_BUDGET by default, of them per frame */
+class ParticleEmitter {
+private:
+  /** Dirty glyphs next to each other on a row, from x0 to x1 */
+  struct source {
+    float x0, x1, y;
+    uint32_t glyphs;
+  };
+
+  std::vector<source> _sources;
+  uint32_t _glyphs;
+  uint32_t _budget;
+  Xorshift8 _rng;
+  std::vector<float> _random;
+  /** Particles each source spawns this frame */
+  std::vector<uint32_t> _counts;
+  /** Sources by the part of a particle their share lost to rounding */
+  std::vector<size_t> _order;
+public:
+  ParticleEmitter();
+  ParticleEmitter(const ParticleEmitter & other) = delete;
+  ParticleEmitter & operator=(const ParticleEmitter & other) = delete;
+
+  void add_source(float x0, float x1, float y, uint32_t glyphs);
+  bool pending() const { return !_sources.empty(); }
+  void set_budget(uint32_t budget) { _budget = budget; }
+  /** Spawns the particles of this frame into system and forgets the
+   * sources */
+  template<typename System> void flush(System & system);
+};
+
+ParticleEmitter::ParticleEmitter()
+  : _glyphs(0),
+    _budget(PARTICLE_BUDGET),
+    _rng(0x5eed) {
+}
+
+void ParticleEmitter::add_source(float x0, float x1, float y, uint32_t glyphs) {
+  _sources.push_back({x0, x1, y, glyphs});
+  _glyphs += glyphs;
+}
+
+template<typename System>
+void ParticleEmitter::flush(System & system) {
+  if (_sources.empty()) {
+    return;
+  }
+  // A screenful of output shares the budget a few keystrokes would use.
+  // The shares are worked out before anything spawns, the particles lost
+  // to rounding them down go to the largest remainders, so every source
+  // gets its part wherever it is on the screen
+  uint32_t want = _glyphs * PARTICLES_PER_GLYPH;
+  uint32_t total = std::min(_budget, want);
+  float scale = want ? total / (float)want : 0.f;
+  auto share = [&](size_t i) {
+    return _sources[i].glyphs * PARTICLES_PER_GLYPH * scale;
+  };
+  uint32_t given = 0;
+  _counts.resize(_sources.size());
+  _order.resize(_sources.size());
+  for (size_t i = 0; i < _sources.size(); ++i) {
+    _counts[i] = (uint32_t)share(i);
+    given += _counts[i];
+    _order[i] = i;
+  }
+  std::sort(_order.begin(), _order.end(), [&](size_t a, size_t b) {
+    return share(a) - _counts[a] > share(b) - _counts[b];
+  });
+  for (size_t i = 0; i < _order.size() && given < total; ++i, ++given) {
+    _counts[_order[i]]++;
+  }
+
+  uint32_t left = _budget;
+  // The flame is painted by the update, this only seeds it
+  const color c = { .r = 1.f, .g = 1.f, .b = 1.f, .a = 0.5f };
+  for (size_t s = 0; s < _sources.size(); ++s) {
+    const source & src = _sources[s];
+    uint32_t n = std::min(_counts[s], left);
+    if (n == 0) {
+      continue;
+    }
+    left -= n;
+
+    // Four uniforms per particle, one stream after the other
+    size_t n8 = (n + 7) & ~7u;
+    _random.resize(4 * n8);
+    _rng.fill(_random.data(), _random.size());
+    const float * u_x = _random.data();
+    const float * u_jitter = u_x + n8;
+    const float * u_dir = u_jitter + n8;
+    const float * u_t = u_dir + n8;
+    for (uint32_t i = 0; i < n; ++i) {
+      const float jitter = -50.f * u_jitter[i] - 10.f;
+      float x_jitter = 2.f * u_dir[i] - 1.f;
+      float y_jitter = sqrt(1 - x_jitter * x_jitter);
+      float t_jitter = 0.3f * u_t[i];
+      glm::vec3 pos(src.x0 + u_x[i] * (src.x1 - src.x0), src.y, 0);
+      glm::vec3 vel(jitter * x_jitter - jitter / 2, -50.f + jitter * y_jitter, 0);
+      system.add_particle(pos, vel, t_jitter, c);
+    }
+  }
+  _sources.clear();
+  _glyphs = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// atlas
+////////////////////////////////////////////////////////////////////////////////
+
+struct glyph_render_params{
+  struct rect uvs;
+  struct vec2 offset;
+};
+
+struct atlas {
+  GlTexture tex;
+  FT_Face face;
+  /** Rendered glyphs from ATLAS_DENSE_GLYPHS on */
+  std::unordered_map<FT_UInt, struct glyph_render_params> uvs;
+  /** Rendered glyphs below ATLAS_DENSE_GLYPHS, by index */
+  std::vector<struct glyph_render_params> dense;
+  std::vector<bool> dense_loaded;
+  unsigned int cx, cy, rowmax;
+
+  atlas(FT_Face my_face):
+    tex(),
+    face(my_face) {
+    glBindTexture(GL_TEXTURE_2D, tex.GetID());
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_R8, ATLAS_SIZE, ATLAS_SIZE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    cx = 0;
+    cy = 0;
+    rowmax = 0;
+  }
+
+  void glyph_render_params(FT_UInt glyph, struct glyph_render_params & out) {
+    if (glyph < ATLAS_DENSE_GLYPHS) {
+      if (glyph < dense.size() && dense_loaded[glyph]) {
+        out = dense[glyph];
+        return;
+      }
+    } else {
+      auto kv = uvs.find(glyph);
+      if (kv != uvs.end()) {
+        out = kv->second;
+        return;
+      }
+    }
+    // render the glyph
+    int error;
+    if ((error = FT_Load_Glyph(face, glyph, FT_LOAD_DEFAULT)) != 0) {
+      die("Failed to load glyph %d %d\n", glyph, error);
+    }
+    if ((error = FT_Render_Glyph(face->glyph, FT_RENDER_MODE_NORMAL)) != 0) {
+      die("Failed to render glyph %d %d\n", glyph, error);
+    }
+    FT_Bitmap * bm = &face->glyph->bitmap;
+    if (cx + bm->width >= ATLAS_SIZE) {
+      cx = 0;
+      cy += rowmax + 1;
+      if (cy >= ATLAS_SIZE) {
+        die("Ran out of space in atlas!\n");
+      }
+      rowmax = 0;
+    }
+    if (bm->rows > rowmax) {
+      rowmax = bm->rows;
     }
     out.offset.x = face->glyph->bitmap_left;
     out.offset.y = face->glyph->bitmap_top;
@@ -668,7 +1703,16 @@ struct atlas {
 
     cx += bm->width + 1;
 
-    uvs.insert({glyph, out});
+    if (glyph < ATLAS_DENSE_GLYPHS) {
+      if (glyph >= dense.size()) {
+        dense.resize(glyph + 1);
+        dense_loaded.resize(glyph + 1);
+      }
+      dense[glyph] = out;
+      dense_loaded[glyph] = true;
+    } else {
+      uvs.insert({glyph, out});
+    }
   }
 
   void bind_texture(int binding) {
@@ -678,44 +1722,121 @@ struct atlas {
 };
 
 ////////////////////////////////////////////////////////////////////////////////
-// FontBatch
+// RowSlots
 ////////////////////////////////////////////////////////////////////////////////
 
-class FontBatch {
+/** Where the vertices of each row sit in the buffer of a batch. A row
+ * keeps its slot while its vertices fit, so changing a row rewrites only
+ * that part of the buffer */
+class RowSlots {
 private:
-  std::shared_ptr<GlBuffer<vertex>> _verts;
-  std::shared_ptr<GlVAO<vertex>> _vert_vao;
+  const static GLint MAX_ELEMS = 65535;
+
+  std::vector<GLint> _firsts;
+  std::vector<GLsizei> _counts;
+  std::vector<GLsizei> _caps;
+  /** End of the last slot handed out */
+  GLint _end;
+  /** Vertices in all slots */
+  GLsizei _used;
+public:
+  RowSlots();
+
+  /** Returns where the count vertices of row go, or -1 if they fit neither
+   * in its slot nor in a new one */
+  GLint place(size_t row, GLsizei count);
+  /** Forgets every slot, places after this lay the buffer out again */
+  void clear();
+  bool empty() const { return _used == 0; }
+  /** Draws the vertices of every row with a single call */
+  void draw() const;
+};
+
+RowSlots::RowSlots()
+  : _end(0),
+    _used(0) {
+}
+
+GLint RowSlots::place(size_t row, GLsizei count) {
+  if (row >= _firsts.size()) {
+    _firsts.resize(row + 1, 0);
+    _counts.resize(row + 1, 0);
+    _caps.resize(row + 1, 0);
+  }
+  if (count > _caps[row]) {
+    // A row that outgrew its slot moves to the end with room to grow, the
+    // hole it leaves goes away with the next clear()
+    GLsizei cap = _caps[row] ? count + count / 2 : count;
+    if (_end + cap > MAX_ELEMS) {
+      return -1;
+    }
+    _firsts[row] = _end;
+    _caps[row] = cap;
+    _end += cap;
+  }
+  _used += count - _counts[row];
+  _counts[row] = count;
+  return _firsts[row];
+}
+
+void RowSlots::clear() {
+  _firsts.clear();
+  _counts.clear();
+  _caps.clear();
+  _end = 0;
+  _used = 0;
+}
+
+void RowSlots::draw() const {
+  glMultiDrawArrays(GL_TRIANGLES, _firsts.data(), _counts.data(), _firsts.size());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// CellBatch
+////////////////////////////////////////////////////////////////////////////////
+
+/** Cell geometry of a set of rows, drawn with a single call */
+class CellBatch {
+private:
+  std::shared_ptr<GlBuffer<cell_vertex>> _verts;
+  std::shared_ptr<GlVAO<cell_vertex>> _vert_vao;
+  RowSlots _slots;
 public:
-  FontBatch();
-  FontBatch(const FontBatch & other) = delete;
-  FontBatch(FontBatch && other);
-  FontBatch & operator=(const FontBatch & other) = delete;
-  FontBatch & operator=(FontBatch && other);
-  ~FontBatch();
-
-  void enqueue_glyph(const glyph_spec * const spec);
+  CellBatch();
+  CellBatch(const CellBatch & other) = delete;
+  CellBatch(CellBatch && other);
+  CellBatch & operator=(const CellBatch & other) = delete;
+  CellBatch & operator=(CellBatch && other);
+  ~CellBatch();
+
+  /** Replaces the vertices of row, false if there is no room for them */
+  bool write(size_t row, const std::vector<cell_vertex> & verts);
+  void sync();
   void render();
+  void clear();
+  bool empty() const;
 };
 
-FontBatch::FontBatch() :
-  _verts(new GlBuffer<vertex>()),
-  _vert_vao(new GlVAO<vertex>(_verts)) {
+CellBatch::CellBatch() :
+  _verts(new GlBuffer<cell_vertex>()),
+  _vert_vao(new GlVAO<cell_vertex>(_verts)) {
   _vert_vao->enable_attrib(POSITION_LOCATION);
   _vert_vao->enable_attrib(UV_LOCATION);
-  _vert_vao->enable_attrib(COLOR_LOCATION);
+  _vert_vao->enable_attrib(CELL_LOCATION);
 
   _vert_vao->bind_attrib(POSITION_LOCATION, 0);
   _vert_vao->bind_attrib(UV_LOCATION, 0);
-  _vert_vao->bind_attrib(COLOR_LOCATION, 0);
+  _vert_vao->bind_attrib(CELL_LOCATION, 0);
 
-  _vert_vao->attrib_format(POSITION_LOCATION, 3, GL_FLOAT, GL_FALSE, offsetof(vertex, pos));
-  _vert_vao->attrib_format(UV_LOCATION, 2, GL_FLOAT, GL_FALSE, offsetof(vertex, texcoords));
-  _vert_vao->attrib_format(COLOR_LOCATION, 4, GL_FLOAT, GL_FALSE, offsetof(vertex, c));
+  _vert_vao->attrib_format(POSITION_LOCATION, 3, GL_FLOAT, GL_FALSE, offsetof(cell_vertex, pos));
+  _vert_vao->attrib_format(UV_LOCATION, 2, GL_FLOAT, GL_FALSE, offsetof(cell_vertex, texcoords));
+  _vert_vao->attrib_iformat(CELL_LOCATION, 3, GL_UNSIGNED_INT, offsetof(cell_vertex, fg));
 }
 
-FontBatch::~FontBatch() {}
+CellBatch::~CellBatch() {}
 
-void FontBatch::enqueue_glyph(const glyph_spec * const spec) {
+/** Appends the two triangles for a glyph to out */
+static void glyph_vertices(const glyph_spec * const spec, const cell_attr & a, std::vector<cell_vertex> & out) {
   struct glyph_render_params rps;
   spec->font->glyph_render_params(spec->glyph, rps);
 
@@ -729,7 +1850,7 @@ void FontBatch::enqueue_glyph(const glyph_spec * const spec) {
     return;
   }
 
-  vertex lverts[4] = {
+  cell_vertex lverts[4] = {
     {
       .pos = {
         .x = base_x,
@@ -737,7 +1858,7 @@ void FontBatch::enqueue_glyph(const glyph_spec * const spec) {
         .z = 0,
       },
       .texcoords = rps.uvs.origin,
-      .c = *spec->c
+      .fg = a.fg, .bg = a.bg, .mode = a.mode
     },
     {
       .pos = {
@@ -749,7 +1870,7 @@ void FontBatch::enqueue_glyph(const glyph_spec * const spec) {
         .x = rps.uvs.origin.x + rps.uvs.size.x,
         .y = rps.uvs.origin.y + rps.uvs.size.y,
       },
-      .c = *spec->c
+      .fg = a.fg, .bg = a.bg, .mode = a.mode
     },
     {
       .pos = {
@@ -761,7 +1882,7 @@ void FontBatch::enqueue_glyph(const glyph_spec * const spec) {
         .x = rps.uvs.origin.x,
         .y = rps.uvs.origin.y + rps.uvs.size.y,
       },
-      .c = *spec->c
+      .fg = a.fg, .bg = a.bg, .mode = a.mode
     },
     {
       .pos = {
@@ -773,22 +1894,41 @@ void FontBatch::enqueue_glyph(const glyph_spec * const spec) {
         .x = rps.uvs.origin.x + rps.uvs.size.x,
         .y = rps.uvs.origin.y,
       },
-      .c = *spec->c
+      .fg = a.fg, .bg = a.bg, .mode = a.mode
     },
   };
 
-  _verts->push_elements(lverts, 3);
+  out.insert(out.end(), lverts, lverts + 3);
   lverts[2] = lverts[3];
-  _verts->push_elements(lverts, 3);
+  out.insert(out.end(), lverts, lverts + 3);
 }
 
-void FontBatch::render() {
-  _vert_vao->bind_buffer(_verts, 0, 0, sizeof(vertex));
+bool CellBatch::write(size_t row, const std::vector<cell_vertex> & verts) {
+  GLint first = _slots.place(row, verts.size());
+  if (first < 0) {
+    return false;
+  }
+  _verts->write_elements(first, verts.data(), verts.size());
+  return true;
+}
 
+void CellBatch::sync() {
   _verts->sync();
+}
+
+void CellBatch::render() {
+  _vert_vao->bind_buffer(_verts, 0, 0, sizeof(cell_vertex));
   _vert_vao->bind();
-  glDrawArrays(GL_TRIANGLES, 0, _verts->num_elems());
+  _slots.draw();
+}
+
+void CellBatch::clear() {
   _verts->clear();
+  _slots.clear();
+}
+
+bool CellBatch::empty() const {
+  return _slots.empty();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -808,7 +1948,8 @@ public:
   FBBlitJob& operator=(const FBBlitJob && other) = delete;
   ~FBBlitJob();
 
-  void do_blit(GLuint backing_texture);
+  /** Draws the bottom left used_w x used_h of fb over the viewport */
+  void do_blit(const GlFrameBuffer & fb, GLsizei used_w, GLsizei used_h);
 };
 
 FBBlitJob::FBBlitJob(std::shared_ptr<GlShader> shader)
@@ -861,12 +2002,19 @@ FBBlitJob::FBBlitJob(std::shared_ptr<GlShader> shader)
 FBBlitJob::~FBBlitJob() {
 }
 
-void FBBlitJob::do_blit(GLuint backing_texture) {
+void FBBlitJob::do_blit(const GlFrameBuffer & fb, GLsizei used_w, GLsizei used_h) {
   _vert_vao->bind_buffer(_verts, 0, 0, sizeof(vertex));
 
-  glBindTextureUnit(TEXTURE_BINDING, backing_texture);
+  glBindTextureUnit(TEXTURE_BINDING, fb.get_main_color());
   _shader->bind();
-  auto transform = glm::mat4(1.f);
+  // Stretch the quad so the used corner of the texture covers the viewport
+  // and the rest is clipped
+  float sx = fb.width() / (float)std::max(used_w, 1);
+  float sy = fb.height() / (float)std::max(used_h, 1);
+  auto transform = glm::mat4(sx, 0.f, 0.f, sx - 1.f,
+                             0.f, sy, 0.f, sy - 1.f,
+                             0.f, 0.f, 1.f, 0.f,
+                             0.f, 0.f, 0.f, 1.f);
   _shader->uniform(TRANSFORM_LOCATION, GL_TRUE, transform);
 
   _vert_vao->bind();
@@ -882,6 +2030,7 @@ private:
   std::shared_ptr<GlShader> _shader;
   std::shared_ptr<GlBuffer<vertex>> _verts;
   std::shared_ptr<GlVAO<vertex>> _vert_vao;
+  RowSlots _slots;
 public:
   RectJob(std::shared_ptr<GlShader> shader);
   RectJob(const RectJob & other) = delete;
@@ -890,8 +2039,11 @@ public:
   RectJob& operator=(const RectJob && other) = delete;
   ~RectJob();
 
-  void draw_rect(const struct color * const c, int x, int y, int w, int h);
+  /** Replaces the rectangles of row, false if there is no room for them */
+  bool write(size_t row, const std::vector<vertex> & verts);
+  void sync();
   void render(const glm::mat4 & transform);
+  void clear();
 };
 
 RectJob::RectJob(std::shared_ptr<GlShader> shader)
@@ -917,15 +2069,32 @@ RectJob::~RectJob() {
 
 void RectJob::render(const glm::mat4 & transform) {
   _vert_vao->bind_buffer(_verts, 0, 0, sizeof(vertex));
-  _verts->sync();
   _shader->bind();
   _shader->uniform(TRANSFORM_LOCATION, GL_TRUE, transform);
   _vert_vao->bind();
-  glDrawArrays(GL_TRIANGLES, 0, _verts->num_elems());
+  _slots.draw();
+}
+
+bool RectJob::write(size_t row, const std::vector<vertex> & verts) {
+  GLint first = _slots.place(row, verts.size());
+  if (first < 0) {
+    return false;
+  }
+  _verts->write_elements(first, verts.data(), verts.size());
+  return true;
+}
+
+void RectJob::sync() {
+  _verts->sync();
+}
+
+void RectJob::clear() {
   _verts->clear();
+  _slots.clear();
 }
 
-void RectJob::draw_rect(const struct color * const c, int xi, int yi, int w, int h) {
+/** Appends the two triangles for a solid rectangle to out */
+static void rect_vertices(const struct color * const c, int xi, int yi, int w, int h, std::vector<vertex> & out) {
   if (w == 0 || h == 0) {
     // Don't enqueue empty rectangles
     return;
@@ -955,200 +2124,660 @@ void RectJob::draw_rect(const struct color * const c, int xi, int yi, int w, int
     },
   };
 
-  _verts->push_elements(lverts, 3);
+  out.insert(out.end(), lverts, lverts + 3);
   lverts[2] = lverts[3];
-  _verts->push_elements(lverts, 3);
+  out.insert(out.end(), lverts, lverts + 3);
 }
 
-////////////////////////////////////////////////////////////////////////////////
-//  render_context
-////////////////////////////////////////////////////////////////////////////////
-
-void flame_curve(float f, color & c) {
-  // t0 = 1
-  // t1 = f
-  float t2 = 2 * f * f - 1;
-  float t3 = f * (2 * t2 - 1); // 2 f t2 -  t1
-  float t4 = 2 * f * t3 - t2;
+/** Appends the two triangles for a rectangle in a resolved cell colour */
+static void cell_rect_vertices(const cell_attr & a, uint32_t mode, int xi, int yi, int w, int h, std::vector<cell_vertex> & out) {
+  if (w == 0 || h == 0) {
+    return;
+  }
+  float x = static_cast<float>(xi);
+  float y = static_cast<float>(yi);
+  cell_vertex lverts[4] = {
+    {
+      .pos = { .x = x, .y = y, .z = 0 },
+      .texcoords = { .x = 0, .y = 0 },
+      .fg = a.fg, .bg = a.bg, .mode = mode
+    },
+    {
+      .pos = { .x = x + w, .y = y + h, .z = 0},
+      .texcoords = { .x = 1, .y = 1 },
+      .fg = a.fg, .bg = a.bg, .mode = mode
+    },
+    {
+      .pos = { .x = x, .y = y + h, .z = 0 },
+      .texcoords = { .x = 0, .y = 1 },
+      .fg = a.fg, .bg = a.bg, .mode = mode
+    },
+    {
+      .pos = { .x = x + w, .y = y, .z = 0 },
+      .texcoords = { .x = 1, .y = 0 },
+      .fg = a.fg, .bg = a.bg, .mode = mode
+    },
+  };
 
-  const float rc[] = { -7.42828172, 13.49066809, -9.02608052,  3.68452288, -0.71117265 };
-  const float gc[] = { -4.56657944, 8.57004895, -6.62752371, 3.5393551, -0.99186063 };
-  const float bc[] = { 8.60556488, -14.57317637,  8.7124878, -3.42279269,  0.7211981 };
-  c.r = rc[0] + f * rc[1] + t2 * rc[2] + t3 * rc[3] + t4 * rc[4];
-  c.g = gc[0] + f * gc[1] + t2 * gc[2] + t3 * gc[3] + t4 * gc[4];
-  c.b = bc[0] + f * bc[1] + t2 * bc[2] + t3 * bc[3] + t4 * bc[4];
-  c.a = 1.f - f;
+  out.insert(out.end(), lverts, lverts + 3);
+  lverts[2] = lverts[3];
+  out.insert(out.end(), lverts, lverts + 3);
 }
 
-void basic_update(particle & p, float dt) {
-  p.t += dt;
-  p.x += dt * p.vx;
-  p.y += dt * p.vy;
-  p.vy += 100.f * dt;
-  flame_curve(p.t, p.c);
-}
+////////////////////////////////////////////////////////////////////////////////
+//  RowGeometry
+////////////////////////////////////////////////////////////////////////////////
 
-struct render_context {
-  GlShader _shader;
-  color _clear_color;
-  std::unique_ptr<GlFrameBuffer> _fb;
-  std::unique_ptr<GlFrameBuffer> _particle_fb;
-  std::unordered_map<struct atlas*, FontBatch> _text_batches;
-  int _win_w;
-  int _win_h;
-  ParticleSystem<std::function<void(particle&, float)>> _parts;
+/** Vertices drawn for one terminal row, or for the per-frame overlay */
+struct RowGeometry {
+  std::vector<vertex> rects;
+  /** Placeholder boxes, and the backgrounds and decorations drawn in the
+   * overlay. Rows keep those in the CellGrid of their layer */
+  std::vector<cell_vertex> cells;
+  std::unordered_map<struct atlas*, std::vector<cell_vertex>> glyphs;
 
-  float _time_since_keypress;
-  float _rotation;
-  glm::vec2 _jounce;
-  float _jounce_factor;
+  void clear() {
+    rects.clear();
+    cells.clear();
+    // Forget fonts the row stopped using, their atlas may be gone by now
+    for (auto it = glyphs.begin(); it != glyphs.end();) {
+      if (it->second.empty()) {
+        it = glyphs.erase(it);
+      } else {
+        it->second.clear();
+        ++it;
+      }
+    }
+  }
+};
 
-  FBBlitJob _fb_blitter;
-  FBBlitJob _particle_blitter;
-  RectJob _rect_job;
+////////////////////////////////////////////////////////////////////////////////
+//  CellGrid
+////////////////////////////////////////////////////////////////////////////////
 
-  void set_size(int w, int h);
-  void set_y_nudge(int y);
-  void do_render();
-  void render_rune(const glyph_spec * spec);
-  void set_clear_color(const color & c);
-  void on_key_press(const TCursor & c, const char * const buf, int buflen);
-  void compute_transform(glm::mat4 & transform);
+/** Backgrounds and decoration lines of a screen, one texel per cell, drawn
+ * with a single quad */
+class CellGrid {
+private:
+  /** Raw colours and attributes of a cell, as cell_grid_frag_shader reads
+   * them */
+  struct texel {
+    uint32_t fg, bg, mode, pad;
+  };
 
-  render_context();
+  GLuint _tex;
+  int _cols, _rows;
+  std::vector<texel> _cells;
+  /** Rows changed since the last upload */
+  std::vector<bool> _dirty;
+  bool _changed;
+  cell_metrics _metrics;
+  std::shared_ptr<GlShader> _shader;
+  std::shared_ptr<GlBuffer<vertex>> _verts;
+  std::shared_ptr<GlVAO<vertex>> _vert_vao;
+
+  void build_quad();
+public:
+  CellGrid(std::shared_ptr<GlShader> shader);
+  CellGrid(const CellGrid & other) = delete;
+  CellGrid & operator=(const CellGrid & other) = delete;
+  ~CellGrid();
+
+  /** Changes the size of the grid, leaving every cell empty */
+  void resize(int cols, int rows);
+  void set_metrics(const cell_metrics & m);
+  void clear_row(int row);
+  void set(int row, int col, const cell_attr & a, int n);
+  /** Uploads the rows changed since the last upload */
+  void upload();
+  void render(const glm::mat4 & transform);
 };
 
-void render_context::compute_transform(glm::mat4 & transform) {
-  // Operations:
-  //  1 scale to [0, 2] x [0, 2]
-  //  2 translate to [-1, -1] x [-1, -1]
-  //  3 rotate a bit
-  //  4 translate by the keypress drop
-  float keypress_drop;
-  if (_time_since_keypress < KEYPRESS_TIMEOUT) {
-    keypress_drop = KEYPRESS_TIMEOUT - _time_since_keypress;
-    keypress_drop /= KEYPRESS_TIMEOUT;
-    float jounce_fac = 1.f / (1.f + exp(_jounce_factor * -JOUNCE_MULTIPLIER + JOUNCE_SHIFT));
-    keypress_drop *= jounce_fac;
-  } else {
-    keypress_drop = 0.f;
-    _jounce = {0, 0};
-    _jounce_factor *= JOUNCE_DECAY_FACTOR;
-  }
+CellGrid::CellGrid(std::shared_ptr<GlShader> shader)
+  : _tex(0),
+    _cols(0),
+    _rows(0),
+    _changed(false),
+    _metrics(),
+    _shader(shader),
+    _verts(new GlBuffer<vertex>()),
+    _vert_vao(new GlVAO<vertex>(_verts))
+{
+  _vert_vao->enable_attrib(POSITION_LOCATION);
+  _vert_vao->enable_attrib(UV_LOCATION);
+  _vert_vao->enable_attrib(COLOR_LOCATION);
 
-  // Get in to eye space
-  float x_scale = 2.f / _win_w;
-  float y_scale = -2.f / _win_h;
-  glm::mat4 trans_matrix = glm::mat4(1.f);
-  trans_matrix[0][3] = _jounce.x * keypress_drop;
-  trans_matrix[1][3] = _jounce.y * keypress_drop;
-  transform = glm::rotate(_rotation * keypress_drop, glm::vec3(0, 0, 1)) * trans_matrix;
-  transform = glm::mat4(x_scale, 0.f, 0.f, -1.f,
-                        0.f, y_scale, 0.f, 1.f,
-                        0.f, 0.f, 1.f, 0.f,
-                        0.f, 0.f, 0.f, 1.f) * transform;
-  // Rotate (3)
-  // Translate by the keypress drop (4)
-  keypress_drop *= font_size;
-  keypress_drop /= _win_h;
-  // transform = transform * ;
-}
+  _vert_vao->bind_attrib(POSITION_LOCATION, 0);
+  _vert_vao->bind_attrib(UV_LOCATION, 0);
+  _vert_vao->bind_attrib(COLOR_LOCATION, 0);
 
-void render_context::do_render() {
-  ///
-  // Update step
-  ///
-  // TODO: use a proper timer here;
-  _parts.do_update(0.16f);
-  _time_since_keypress += 0.16f;
+  _vert_vao->attrib_format(POSITION_LOCATION, 3, GL_FLOAT, GL_FALSE, offsetof(vertex, pos));
+  _vert_vao->attrib_format(UV_LOCATION, 2, GL_FLOAT, GL_FALSE, offsetof(vertex, texcoords));
+  _vert_vao->attrib_format(COLOR_LOCATION, 4, GL_FLOAT, GL_FALSE, offsetof(vertex, c));
+}
 
-  ///
-  // Actual render step
-  ///
+CellGrid::~CellGrid() {
+  glDeleteTextures(1, &_tex);
+}
 
-  // Transform matrix in row major order
-  glm::mat4 transform;
-  compute_transform(transform);
+void CellGrid::build_quad() {
+  // The texture coordinates are pixels into the grid, the fragment shader
+  // finds the cell and the line in it from those
+  float x = _metrics.x, y = _metrics.y;
+  float w = _cols * _metrics.w, h = _rows * _metrics.h;
+  vertex lverts[4] = {
+    {
+      .pos = { .x = x, .y = y, .z = 0 },
+      .texcoords = { .x = 0, .y = 0 },
+      .c = { .r = 1.f, .g = 1.f, .b = 1.f, .a = 1.f }
+    },
+    {
+      .pos = { .x = x + w, .y = y + h, .z = 0 },
+      .texcoords = { .x = w, .y = h },
+      .c = { .r = 1.f, .g = 1.f, .b = 1.f, .a = 1.f }
+    },
+    {
+      .pos = { .x = x, .y = y + h, .z = 0 },
+      .texcoords = { .x = 0, .y = h },
+      .c = { .r = 1.f, .g = 1.f, .b = 1.f, .a = 1.f }
+    },
+    {
+      .pos = { .x = x + w, .y = y, .z = 0 },
+      .texcoords = { .x = w, .y = 0 },
+      .c = { .r = 1.f, .g = 1.f, .b = 1.f, .a = 1.f }
+    },
+  };
 
-  // Render particles
-  _particle_fb->bind(GL_DRAW_FRAMEBUFFER);
-  glViewport(0, 0, _win_w / PARTICLE_FB_SCALE, _win_h / PARTICLE_FB_SCALE);
-  glClearColor(0.f, 0.f, 0.f, 0.f);
-  glClear(GL_COLOR_BUFFER_BIT);
-  _parts.render(transform);
+  _verts->clear();
+  _verts->push_elements(lverts, 3);
+  lverts[2] = lverts[3];
+  _verts->push_elements(lverts, 3);
+  _verts->sync();
+}
 
-  // Bind main framebuffer
-  _fb->bind(GL_DRAW_FRAMEBUFFER);
-  glClearColor(_clear_color.r, _clear_color.g, _clear_color.b, _clear_color.a);
-  glClear(GL_COLOR_BUFFER_BIT);
+void CellGrid::resize(int cols, int rows) {
+  if (cols == _cols && rows == _rows) {
+    return;
+  }
+  _cols = cols;
+  _rows = rows;
+  _cells.assign(cols * rows, texel{0, 0, CELL_EMPTY_BIT, 0});
+  _dirty.assign(rows, true);
+  _changed = true;
+
+  glDeleteTextures(1, &_tex);
+  _tex = 0;
+  if (cols > 0 && rows > 0) {
+    glCreateTextures(GL_TEXTURE_2D, 1, &_tex);
+    glTextureStorage2D(_tex, 1, GL_RGBA32UI, cols, rows);
+    glTextureParameteri(_tex, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTextureParameteri(_tex, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  }
+  build_quad();
+}
+
+void CellGrid::set_metrics(const cell_metrics & m) {
+  if (memcmp(&m, &_metrics, sizeof(m)) == 0) {
+    return;
+  }
+  _metrics = m;
+  build_quad();
+}
 
-  // Update viewport to correct size
-  glViewport(0, 0, _win_w, _win_h);
+void CellGrid::clear_row(int row) {
+  if (row >= _rows) {
+    return;
+  }
+  std::fill_n(_cells.begin() + row * _cols, _cols, texel{0, 0, CELL_EMPTY_BIT, 0});
+  _dirty[row] = true;
+  _changed = true;
+}
 
-  // Render rectangles
+void CellGrid::set(int row, int col, const cell_attr & a, int n) {
+  if (row < 0 || row >= _rows || col < 0) {
+    return;
+  }
+  n = std::min(n, _cols - col);
+  if (n <= 0) {
+    return;
+  }
+  std::fill_n(_cells.begin() + row * _cols + col, n, texel{a.fg, a.bg, a.mode, 0});
+  _dirty[row] = true;
+  _changed = true;
+}
+
+void CellGrid::upload() {
+  if (!_changed) {
+    return;
+  }
+  // One upload per run of changed rows
+  for (int y = 0; y < _rows;) {
+    if (!_dirty[y]) {
+      ++y;
+      continue;
+    }
+    int end = y;
+    while (end < _rows && _dirty[end]) {
+      _dirty[end++] = false;
+    }
+    glTextureSubImage2D(_tex, 0, 0, y, _cols, end - y, GL_RGBA_INTEGER,
+                        GL_UNSIGNED_INT, _cells.data() + y * _cols);
+    y = end;
+  }
+  _changed = false;
+}
+
+void CellGrid::render(const glm::mat4 & transform) {
+  if (_tex == 0 || _metrics.w <= 0 || _metrics.h <= 0) {
+    return;
+  }
+  _vert_vao->bind_buffer(_verts, 0, 0, sizeof(vertex));
+  glBindTextureUnit(CELL_GRID_BINDING, _tex);
+  _shader->bind();
+  _shader->uniform(TRANSFORM_LOCATION, GL_TRUE, transform);
+  _shader->uniform(METRICS_LOCATION, _metrics.w, _metrics.h,
+                   _metrics.underline, _metrics.strike);
+  _vert_vao->bind();
+  glDrawArrays(GL_TRIANGLES, 0, _verts->num_elems());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//  GeometryLayer
+////////////////////////////////////////////////////////////////////////////////
+
+/** A set of rows and the GPU batches they were last uploaded to */
+class GeometryLayer {
+private:
+  std::vector<RowGeometry> _rows;
+  std::unordered_map<struct atlas*, CellBatch> _batches;
+  CellBatch _cells;
+  std::shared_ptr<GlShader> _cell_shader;
+  CellGrid _grid;
+  RectJob _rect_job;
+  /** Rows begun since the last upload */
+  std::vector<bool> _dirty;
+  bool _changed;
+  /** Every row has to be written to new slots */
+  bool _relayout;
+
+  bool write_row(size_t row);
+public:
+  GeometryLayer(std::shared_ptr<GlShader> rect_shader, std::shared_ptr<GlShader> cell_shader,
+                std::shared_ptr<GlShader> grid_shader);
+  GeometryLayer(const GeometryLayer & other) = delete;
+  GeometryLayer & operator=(const GeometryLayer & other) = delete;
+
+  /** Clears a row so it can be drawn again, growing the layer if needed */
+  RowGeometry & begin_row(size_t row);
+  void resize(int cols, int rows);
+  /** Drops the glyphs of a from every row and batch */
+  void forget(struct atlas * a);
+  CellGrid & grid() { return _grid; }
+  /** Writes the rows changed since the last upload to the batches */
+  void upload();
+  void render_rects(const glm::mat4 & transform);
+  void render_glyphs();
+};
+
+GeometryLayer::GeometryLayer(std::shared_ptr<GlShader> rect_shader, std::shared_ptr<GlShader> cell_shader,
+                             std::shared_ptr<GlShader> grid_shader)
+  : _cell_shader(cell_shader),
+    _grid(grid_shader),
+    _rect_job(rect_shader),
+    _changed(false),
+    _relayout(false) {
+}
+
+RowGeometry & GeometryLayer::begin_row(size_t row) {
+  if (row >= _rows.size()) {
+    _rows.resize(row + 1);
+    _dirty.resize(row + 1);
+  }
+  _rows[row].clear();
+  _grid.clear_row(row);
+  _dirty[row] = true;
+  _changed = true;
+  return _rows[row];
+}
+
+void GeometryLayer::resize(int cols, int rows) {
+  _rows.resize(rows);
+  _dirty.resize(rows);
+  _grid.resize(cols, rows);
+  _changed = true;
+  _relayout = true;
+}
+
+void GeometryLayer::forget(struct atlas * a) {
+  for (auto & row : _rows) {
+    if (row.glyphs.erase(a)) {
+      _changed = true;
+    }
+  }
+  _batches.erase(a);
+}
+
+/** Writes row to every batch, false if one had no room for it */
+bool GeometryLayer::write_row(size_t row) {
+  static const std::vector<cell_vertex> none;
+  RowGeometry & geom = _rows[row];
+  bool fits = _rect_job.write(row, geom.rects);
+
+  fits = _cells.write(row, geom.cells) && fits;
+  for (auto & kv : geom.glyphs) {
+    if (!kv.second.empty() && _batches.find(kv.first) == _batches.end()) {
+      _batches.emplace(std::piecewise_construct,
+                       std::forward_as_tuple(kv.first),
+                       std::forward_as_tuple());
+    }
+  }
+  // Batches of fonts the row stopped using lose its glyphs too
+  for (auto & kv : _batches) {
+    auto glyphs = geom.glyphs.find(kv.first);
+    fits = kv.second.write(row, glyphs == geom.glyphs.end() ? none : glyphs->second) && fits;
+  }
+  return fits;
+}
+
+void GeometryLayer::upload() {
+  _grid.upload();
+  if (!_changed) {
+    return;
+  }
+  for (size_t y = 0; y < _rows.size() && !_relayout; ++y) {
+    if (_dirty[y] && !write_row(y)) {
+      _relayout = true;
+    }
+  }
+  if (_relayout) {
+    // Pack every row again, which also drops the holes rows left behind
+    // when they outgrew their slots
+    _rect_job.clear();
+    _cells.clear();
+    for (auto & kv : _batches) {
+      kv.second.clear();
+    }
+    for (size_t y = 0; y < _rows.size(); ++y) {
+      if (!write_row(y)) {
+        fprintf(stderr, "Warning: too many elements, not drawing row %zu\n", y);
+      }
+    }
+  }
+  _rect_job.sync();
+  _cells.sync();
+  for (auto it = _batches.begin(); it != _batches.end();) {
+    if (it->second.empty()) {
+      it = _batches.erase(it);
+    } else {
+      it->second.sync();
+      ++it;
+    }
+  }
+  std::fill(_dirty.begin(), _dirty.end(), false);
+  _changed = false;
+  _relayout = false;
+}
+
+void GeometryLayer::render_rects(const glm::mat4 & transform) {
+  _grid.render(transform);
+  if (!_cells.empty()) {
+    _cell_shader->bind();
+    _cell_shader->uniform(TRANSFORM_LOCATION, GL_TRUE, transform);
+    _cells.render();
+  }
   _rect_job.render(transform);
+}
 
-  // Render fonts
-  glEnable(GL_BLEND);
-  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-  {
-    _shader.bind();
-    _shader.uniform(TRANSFORM_LOCATION, GL_TRUE, transform);
-
-    _shader.bind();
-    for (auto & kv : _text_batches) {
-      kv.first->bind_texture(TEXTURE_BINDING);
-      kv.second.render();
+void GeometryLayer::render_glyphs() {
+  for (auto & kv : _batches) {
+    kv.first->bind_texture(TEXTURE_BINDING);
+    kv.second.render();
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//  render_context
+////////////////////////////////////////////////////////////////////////////////
+
+/** Monotonic time handed out in fixed ANIMATION_STEPs */
+class AnimationClock {
+private:
+  std::chrono::steady_clock::time_point _last;
+  /** Seconds passed but not handed out yet, less than a step */
+  float _behind;
+public:
+  AnimationClock();
+
+  /** Returns how many steps passed since the last call */
+  int advance();
+  /** How far into the next step the clock is, from 0 to 1 */
+  float alpha() const { return _behind / ANIMATION_STEP; }
+};
+
+AnimationClock::AnimationClock()
+  : _last(std::chrono::steady_clock::now()),
+    _behind(0.f) {
+}
+
+int AnimationClock::advance() {
+  auto now = std::chrono::steady_clock::now();
+  _behind += std::chrono::duration<float>(now - _last).count();
+  _last = now;
+  int steps = _behind / ANIMATION_STEP;
+  _behind -= steps * ANIMATION_STEP;
+  return steps;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//  EffectGovernor
+////////////////////////////////////////////////////////////////////////////////
+
+/** How much the effects may cost */
+struct effect_quality {
+  uint32_t particle_budget;
+  int particle_fb_scale;
+  bool jounce;
+};
+
+/** From full effects down to none, the governor moves along these */
+static const effect_quality effect_tiers[] = {
+  { PARTICLE_BUDGET,      PARTICLE_FB_SCALE,     true },
+  { PARTICLE_BUDGET / 4,  PARTICLE_FB_SCALE,     true },
+  { PARTICLE_BUDGET / 16, 2 * PARTICLE_FB_SCALE, false },
+  { 0,                    2 * PARTICLE_FB_SCALE, false },
+};
+
+/** Measures what frames cost on the CPU and the GPU. Lowers the effect
+ * tier while they take longer than 1 / xfps, and raises it again after
+ * they stayed under half of that for a while */
+class EffectGovernor {
+private:
+  GLuint _queries[GOVERNOR_QUERIES];
+  /** Oldest query whose result was not read, and how many are in flight */
+  int _first;
+  int _pending;
+  bool _timing;
+  std::chrono::steady_clock::time_point _start;
+  /** Smoothed frame times in milliseconds */
+  float _cpu_ms;
+  float _gpu_ms;
+  /** Frames in a row over budget, and well under it */
+  int _over;
+  int _under;
+  int _tier;
+public:
+  EffectGovernor();
+  EffectGovernor(const EffectGovernor & other) = delete;
+  EffectGovernor & operator=(const EffectGovernor & other) = delete;
+  ~EffectGovernor();
+
+  void begin_frame();
+  /** Returns whether the tier changed */
+  bool end_frame();
+  int tier() const { return _tier; }
+  const effect_quality & quality() const { return effect_tiers[_tier]; }
+};
+
+EffectGovernor::EffectGovernor()
+  : _first(0),
+    _pending(0),
+    _timing(false),
+    _cpu_ms(0.f),
+    _gpu_ms(0.f),
+    _over(0),
+    _under(0),
+    _tier(0) {
+  glGenQueries(GOVERNOR_QUERIES, _queries);
+}
+
+EffectGovernor::~EffectGovernor() {
+  glDeleteQueries(GOVERNOR_QUERIES, _queries);
+}
+
+void EffectGovernor::begin_frame() {
+  _start = std::chrono::steady_clock::now();
+  // Without a free query this frame goes untimed on the GPU
+  _timing = _pending < GOVERNOR_QUERIES;
+  if (_timing) {
+    glBeginQuery(GL_TIME_ELAPSED, _queries[(_first + _pending) % GOVERNOR_QUERIES]);
+  }
+}
+
+bool EffectGovernor::end_frame() {
+  float cpu_ms = std::chrono::duration<float, std::milli>(
+    std::chrono::steady_clock::now() - _start).count();
+  _cpu_ms += 0.1f * (cpu_ms - _cpu_ms);
+  if (_timing) {
+    glEndQuery(GL_TIME_ELAPSED);
+    ++_pending;
+  }
+
+  // Read what finished without waiting on the GPU
+  while (_pending > 0) {
+    GLint available;
+    glGetQueryObjectiv(_queries[_first], GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available) {
+      break;
     }
+    GLuint64 ns;
+    glGetQueryObjectui64v(_queries[_first], GL_QUERY_RESULT, &ns);
+    _gpu_ms += 0.1f * (ns / 1e6f - _gpu_ms);
+    _first = (_first + 1) % GOVERNOR_QUERIES;
+    --_pending;
   }
 
-  // Blit particles
-  _particle_blitter.do_blit(_particle_fb->get_main_color());
-  glDisable(GL_BLEND);
+  float budget_ms = 1000.f / xfps;
+  float frame_ms = std::max(_cpu_ms, _gpu_ms);
+  _over = frame_ms > budget_ms ? _over + 1 : 0;
+  _under = frame_ms < budget_ms / 2 ? _under + 1 : 0;
 
-  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
-  _fb_blitter.do_blit(_fb->get_main_color());
+  int tier = _tier;
+  if (_over >= GOVERNOR_DOWN_FRAMES && _tier + 1 < (int)LEN(effect_tiers)) {
+    ++_tier;
+  } else if (_under >= GOVERNOR_UP_FRAMES && _tier > 0) {
+    --_tier;
+  }
+  if (tier == _tier) {
+    return false;
+  }
+  _over = _under = 0;
+  return true;
 }
 
-void render_context::render_rune(const glyph_spec * spec) {
-  auto kv = _text_batches.find(spec->font);
-  if (kv == _text_batches.end()) {
-    kv = _text_batches.emplace(std::piecewise_construct,
-                               std::forward_as_tuple(spec->font),
-                               std::forward_as_tuple()).first;
+/** Whether GL is rasterized on the CPU, like Mesa's llvmpipe */
+static bool software_renderer() {
+  const char * renderer = (const char *)glGetString(GL_RENDERER);
+  if (!renderer) {
+    return false;
   }
-  if (spec->dirty) {
-    color c = *spec->c;
-    c.a = 0.5f;
-    for (int i = 0; i < 512; ++i) {
-      const float jitter = -50.f * (rand() /(float) RAND_MAX) - 10.f;
-      float x_jitter = 2.f * rand() / (float) RAND_MAX - 1.f;
-      float y_jitter = sqrt(1 - x_jitter * x_jitter);
-      float t_jitter = 0.3f * (rand() / (float) RAND_MAX);
-      _parts.add_particle(glm::vec3(spec->x, spec->y, 0),
-                          glm::vec3(jitter * x_jitter - jitter / 2, -50.f + jitter * y_jitter, 0),
-                          t_jitter, c);
+  for (const char * name : {"llvmpipe", "softpipe", "SWR", "Software Rasterizer"}) {
+    if (strstr(renderer, name)) {
+      return true;
     }
   }
-  kv->second.enqueue_glyph(spec);
+  return false;
 }
 
-void render_context::set_clear_color(const color & c) {
-  _clear_color = c;
+////////////////////////////////////////////////////////////////////////////////
+//  Effects
+////////////////////////////////////////////////////////////////////////////////
+
+/** The fire particles and the keypress jounce around the text */
+class EffectStack {
+private:
+  /** Particles are simulated by exactly one of these */
+  std::unique_ptr<ParticleSystem<BasicUpdate>> _parts;
+  std::unique_ptr<GpuParticleSystem> _gpu_parts;
+  ParticleEmitter _emitter;
+  std::unique_ptr<GlFrameBuffer> _particle_fb;
+  int _particle_fb_scale;
+  FBBlitJob _particle_blitter;
+
+  AnimationClock _clock;
+  EffectGovernor _governor;
+  /** Effect time since the last step, particles are drawn moved on by it */
+  float _lead;
+  float _time_since_keypress;
+  float _rotation;
+  glm::vec2 _jounce;
+  float _jounce_factor;
+  int _win_w;
+  int _win_h;
+
+  RenderTargetPool & _targets;
+
+  void step(int steps);
+  void apply_quality(const effect_quality & q);
+public:
+  explicit EffectStack(RenderTargetPool & targets);
+  EffectStack(const EffectStack & other) = delete;
+  EffectStack & operator=(const EffectStack & other) = delete;
+
+  void set_size(int w, int h);
+  void add_source(float x0, float x1, float y, uint32_t glyphs) { _emitter.add_source(x0, x1, y, glyphs); }
+  void on_key_press(const TCursor & c);
+  /** Spawns and simulates up to now, before anything is drawn */
+  void begin_frame();
+  void end_frame();
+  /** The rotation and drop of the keypress jounce, in window space */
+  glm::mat4 transform() const;
+  bool particles() const { return _gpu_parts ? _gpu_parts->alive() : _parts->alive(); }
+  /** Draws the particles into their own framebuffer */
+  void render_particles(const glm::mat4 & transform);
+  /** Blends the particle framebuffer over what is bound */
+  void composite();
+  bool animating() const;
+  int tier() const { return _governor.tier(); }
+};
+
+EffectStack::EffectStack(RenderTargetPool & targets)
+  : _particle_fb_scale(PARTICLE_FB_SCALE),
+    _particle_blitter(std::make_shared<GlShader>(std::string(vert_shader), std::string(particle_blit_shader))),
+    _lead(0.f),
+    _time_since_keypress(10000.f),
+    _rotation(0.f),
+    _jounce(0.f),
+    _jounce_factor(0.f),
+    _win_w(1),
+    _win_h(1),
+    _targets(targets) {
+  _targets.fit(_particle_fb, 1, 1);
+  // Software GL runs compute shaders on the CPU too, only slower than the
+  // plain loop
+  if (software_renderer()) {
+    _parts.reset(new ParticleSystem<BasicUpdate>(BasicUpdate(), 16.f));
+  } else {
+    _gpu_parts.reset(new GpuParticleSystem(16.f));
+  }
 }
 
-void render_context::set_size(int w, int h) {
+void EffectStack::set_size(int w, int h) {
   _win_w = w;
   _win_h = h;
-  _fb.reset(new GlFrameBuffer(w, h, false, GL_DEPTH_COMPONENT24));
-  _particle_fb.reset(new GlFrameBuffer(w / PARTICLE_FB_SCALE, h / PARTICLE_FB_SCALE, false, GL_DEPTH_COMPONENT24));
-}
-
-void render_context::set_y_nudge(int y) {
-  printf("Y nudged %d\n", y);
+  _targets.fit(_particle_fb, w / _particle_fb_scale, h / _particle_fb_scale);
 }
 
-void render_context::on_key_press(const TCursor & c, const char * const buf, int buflen) {
+void EffectStack::on_key_press(const TCursor & c) {
   _time_since_keypress = 0.f;
   glm::vec2 keypress_loc;
   keypress_loc.x = c.x * font_size;
@@ -1167,20 +2796,447 @@ void render_context::on_key_press(const TCursor & c, const char * const buf, int
   }
 }
 
+void EffectStack::step(int steps) {
+  // Particles are only simulated so many steps, after a pause the rest of
+  // the time just ages them, which drops those that would have died
+  int simulated = std::min(steps, ANIMATION_MAX_STEPS);
+  for (int i = 0; i < simulated; ++i) {
+    if (_gpu_parts) {
+      _gpu_parts->do_update(ANIMATION_UNIT);
+    } else {
+      _parts->do_update(ANIMATION_UNIT);
+    }
+  }
+  if (steps > simulated) {
+    if (_gpu_parts) {
+      _gpu_parts->age((steps - simulated) * ANIMATION_UNIT);
+    } else {
+      _parts->age((steps - simulated) * ANIMATION_UNIT);
+    }
+  }
+  for (int i = 0; i < steps; ++i) {
+    _time_since_keypress += ANIMATION_UNIT;
+    if (_time_since_keypress >= KEYPRESS_TIMEOUT) {
+      // Only the jounce decays from here on, every step
+      _jounce = {0, 0};
+      _jounce_factor *= pow(JOUNCE_DECAY_FACTOR, steps - i);
+      break;
+    }
+  }
+}
+
+void EffectStack::apply_quality(const effect_quality & q) {
+  _emitter.set_budget(q.particle_budget);
+  if (q.particle_fb_scale != _particle_fb_scale) {
+    _particle_fb_scale = q.particle_fb_scale;
+    set_size(_win_w, _win_h);
+  }
+}
+
+void EffectStack::begin_frame() {
+  _governor.begin_frame();
+  if (_gpu_parts) {
+    _emitter.flush(*_gpu_parts);
+  } else {
+    _emitter.flush(*_parts);
+  }
+  step(_clock.advance());
+  _lead = _clock.alpha() * ANIMATION_UNIT;
+}
+
+void EffectStack::end_frame() {
+  if (_governor.end_frame()) {
+    apply_quality(_governor.quality());
+  }
+}
+
+glm::mat4 EffectStack::transform() const {
+  float keypress_drop;
+  // Between steps, so the drop eases out smoothly at any frame rate
+  float since_keypress = _time_since_keypress + _lead;
+  if (since_keypress < KEYPRESS_TIMEOUT && _governor.quality().jounce) {
+    keypress_drop = KEYPRESS_TIMEOUT - since_keypress;
+    keypress_drop /= KEYPRESS_TIMEOUT;
+    float jounce_fac = 1.f / (1.f + exp(_jounce_factor * -JOUNCE_MULTIPLIER + JOUNCE_SHIFT));
+    keypress_drop *= jounce_fac;
+  } else {
+    keypress_drop = 0.f;
+  }
+
+  glm::mat4 trans_matrix = glm::mat4(1.f);
+  trans_matrix[0][3] = _jounce.x * keypress_drop;
+  trans_matrix[1][3] = _jounce.y * keypress_drop;
+  return glm::rotate(_rotation * keypress_drop, glm::vec3(0, 0, 1)) * trans_matrix;
+}
+
+void EffectStack::render_particles(const glm::mat4 & transform) {
+  _particle_fb->bind(GL_DRAW_FRAMEBUFFER);
+  glViewport(0, 0, _win_w / _particle_fb_scale, _win_h / _particle_fb_scale);
+  glClearColor(0.f, 0.f, 0.f, 0.f);
+  glClear(GL_COLOR_BUFFER_BIT);
+  if (_gpu_parts) {
+    _gpu_parts->render(transform, _lead);
+  } else {
+    _parts->render(transform, _lead);
+  }
+}
+
+void EffectStack::composite() {
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  _particle_blitter.do_blit(*_particle_fb, _win_w / _particle_fb_scale, _win_h / _particle_fb_scale);
+  glDisable(GL_BLEND);
+}
+
+bool EffectStack::animating() const {
+  return particles() || _emitter.pending() || _time_since_keypress < KEYPRESS_TIMEOUT;
+}
+
+/** Takes the place of EffectStack in text-only builds, it holds no GL
+ * objects and every call compiles away */
+class NoEffects {
+public:
+  explicit NoEffects(RenderTargetPool &) {}
+  void set_size(int, int) {}
+  void add_source(float, float, float, uint32_t) {}
+  void on_key_press(const TCursor &) {}
+  void begin_frame() {}
+  void end_frame() {}
+  glm::mat4 transform() const { return glm::mat4(1.f); }
+  bool particles() const { return false; }
+  void render_particles(const glm::mat4 &) {}
+  void composite() {}
+  bool animating() const { return false; }
+  int tier() const { return 0; }
+};
+
+/** The effects built in, EFFECTS=0 in config.mk leaves only the text */
+typedef std::conditional<EFFECTS, EffectStack, NoEffects>::type effect_policy;
+
+/** What a frame may draw, in this order */
+enum render_pass {
+  PASS_PARTICLES, // particles into _particle_fb
+  PASS_SCENE,     // cells and glyphs into the window, or _fb
+  PASS_COMPOSITE, // _particle_fb over the scene
+  PASS_PRESENT,   // _fb into the window
+  NUM_PASSES
+};
+
+static const char * const render_pass_names[NUM_PASSES] = {
+  "particles", "scene", "composite", "present"
+};
+
+struct render_context {
+  GlShader _shader;
+  color _clear_color;
+  /** Offscreen scene and its copy to the window, only there while
+   * _retain_scene */
+  std::unique_ptr<GlFrameBuffer> _fb;
+  std::unique_ptr<FBBlitJob> _fb_blitter;
+  bool _retain_scene;
+  RenderTargetPool _targets;
+  /** Passes of the current frame, see build_passes() */
+  std::vector<render_pass> _passes;
+  std::string _pass_description;
+  std::shared_ptr<GlShader> _color_shader;
+  std::shared_ptr<GlShader> _cell_color_shader;
+  std::shared_ptr<GlShader> _grid_shader;
+  Palette _palette;
+  /** Retained rows of the primary and the alternate screen */
+  GeometryLayer _screens[2];
+  int _screen;
+  /** Geometry that only lives for the current frame, like the cursor */
+  GeometryLayer _overlay;
+  /** Where draw calls currently end up, either a row or the overlay */
+  RowGeometry * _target;
+  bool _target_overlay;
+  cell_metrics _metrics;
+  int _win_w;
+  int _win_h;
+  effect_policy _effects;
+
+  void set_size(int w, int h);
+  void set_y_nudge(int y);
+  void do_render();
+  void begin_row(int row);
+  void begin_overlay();
+  void set_grid(int cols, int rows, const cell_metrics & m);
+  void set_screen(int alt);
+  void forget_atlas(struct atlas * a);
+  void render_placeholder(const glyph_spec * spec, const cell_attr & a);
+  void render_runes(const glyph_spec * specs, int n, const cell_attr & a);
+  void render_rect(const color * const c, int x, int y, int w, int h);
+  void render_cells(const cell_attr & a, int col, int row, int n);
+  void set_clear_color(const color & c);
+  void on_key_press(const TCursor & c, const char * const buf, int buflen);
+  void compute_transform(glm::mat4 & transform);
+  void build_passes();
+  const char * describe_passes();
+
+  render_context();
+};
+
+void render_context::compute_transform(glm::mat4 & transform) {
+  // Operations:
+  //  1 rotate a bit and translate by the keypress drop, with effects
+  //  2 scale to [0, 2] x [0, 2]
+  //  3 translate to [-1, -1] x [-1, -1]
+  float x_scale = 2.f / _win_w;
+  float y_scale = -2.f / _win_h;
+  transform = glm::mat4(x_scale, 0.f, 0.f, -1.f,
+                        0.f, y_scale, 0.f, 1.f,
+                        0.f, 0.f, 1.f, 0.f,
+                        0.f, 0.f, 0.f, 1.f) * _effects.transform();
+}
+
+void render_context::build_passes() {
+  // Passes that would draw nothing are left out, the scene goes straight
+  // to the window unless it has to be kept
+  bool particles = _effects.particles();
+  _passes.clear();
+  if (particles) {
+    _passes.push_back(PASS_PARTICLES);
+  }
+  _passes.push_back(PASS_SCENE);
+  if (particles) {
+    _passes.push_back(PASS_COMPOSITE);
+  }
+  if (_retain_scene) {
+    _passes.push_back(PASS_PRESENT);
+  }
+}
+
+const char * render_context::describe_passes() {
+  _pass_description.clear();
+  for (auto pass : _passes) {
+    if (!_pass_description.empty()) {
+      _pass_description += ' ';
+    }
+    _pass_description += render_pass_names[pass];
+  }
+  return _pass_description.c_str();
+}
+
+void render_context::do_render() {
+  ///
+  // Update step
+  ///
+  _effects.begin_frame();
+
+  ///
+  // Upload step
+  ///
+  _screens[_screen].upload();
+  _overlay.upload();
+  begin_overlay();
+
+  ///
+  // Actual render step
+  ///
+
+  // Transform matrix in row major order
+  glm::mat4 transform;
+  compute_transform(transform);
+
+  build_passes();
+  for (auto pass : _passes) {
+    switch (pass) {
+    case PASS_PARTICLES:
+      _effects.render_particles(transform);
+      break;
+
+    case PASS_SCENE:
+      if (_retain_scene) {
+        _fb->bind(GL_DRAW_FRAMEBUFFER);
+      } else {
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+      }
+      glViewport(0, 0, _win_w, _win_h);
+      glClearColor(_clear_color.r, _clear_color.g, _clear_color.b, _clear_color.a);
+      glClear(GL_COLOR_BUFFER_BIT);
+
+      // Render rectangles
+      _palette.bind(PALETTE_BINDING);
+      _screens[_screen].render_rects(transform);
+      _overlay.render_rects(transform);
+
+      // Render fonts
+      glEnable(GL_BLEND);
+      glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+      _shader.bind();
+      _shader.uniform(TRANSFORM_LOCATION, GL_TRUE, transform);
+      _screens[_screen].render_glyphs();
+      _overlay.render_glyphs();
+      glDisable(GL_BLEND);
+      break;
+
+    case PASS_COMPOSITE:
+      // Over the scene, which is still bound
+      _effects.composite();
+      break;
+
+    case PASS_PRESENT:
+      glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+      _fb_blitter->do_blit(*_fb, _win_w, _win_h);
+      break;
+
+    case NUM_PASSES:
+      break;
+    }
+  }
+
+  _effects.end_frame();
+}
+
+void render_context::begin_row(int row) {
+  if (row < 0) {
+    return;
+  }
+  _target = &_screens[_screen].begin_row(row);
+  _target_overlay = false;
+}
+
+void render_context::begin_overlay() {
+  // Only what is drawn from here on shows in the overlay this frame
+  _target = &_overlay.begin_row(0);
+  _target_overlay = true;
+}
+
+void render_context::set_grid(int cols, int rows, const cell_metrics & m) {
+  for (auto & screen : _screens) {
+    screen.resize(cols, rows);
+    screen.grid().set_metrics(m);
+  }
+  _metrics = m;
+  begin_overlay();
+}
+
+void render_context::set_screen(int alt) {
+  _screen = alt ? 1 : 0;
+  begin_overlay();
+}
+
+void render_context::forget_atlas(struct atlas * a) {
+  for (auto & screen : _screens) {
+    screen.forget(a);
+  }
+  _overlay.forget(a);
+}
+
+void render_context::render_rect(const color * const c, int x, int y, int w, int h) {
+  rect_vertices(c, x, y, w, h, _target->rects);
+}
+
+void render_context::render_cells(const cell_attr & a, int col, int row, int n) {
+  if (!_target_overlay) {
+    _screens[_screen].grid().set(row, col, a, n);
+    return;
+  }
+  // The overlay has no grid of its own, it is drawn over the screen
+  int x = _metrics.x + col * _metrics.w;
+  int y = _metrics.y + row * _metrics.h;
+  int w = n * _metrics.w;
+  cell_rect_vertices(a, a.mode | CELL_BG_BIT, x, y, w, _metrics.h, _target->cells);
+  if (a.mode & ATTR_UNDERLINE) {
+    cell_rect_vertices(a, a.mode, x, y + _metrics.underline, w, 1, _target->cells);
+  }
+  if (a.mode & ATTR_STRUCK) {
+    cell_rect_vertices(a, a.mode, x, y + _metrics.strike, w, 1, _target->cells);
+  }
+}
+
+void render_context::render_placeholder(const glyph_spec * spec, const cell_attr & a) {
+  // Outline of the cell, one pixel in
+  int x = spec->x + 1;
+  int y = spec->y - _metrics.baseline + 1;
+  int w = _metrics.w - 2;
+  int h = _metrics.h - 2;
+  if (w <= 0 || h <= 0) {
+    return;
+  }
+  cell_rect_vertices(a, a.mode, x, y, w, 1, _target->cells);
+  cell_rect_vertices(a, a.mode, x, y + h - 1, w, 1, _target->cells);
+  cell_rect_vertices(a, a.mode, x, y, 1, h, _target->cells);
+  cell_rect_vertices(a, a.mode, x + w - 1, y, 1, h, _target->cells);
+}
+
+void render_context::render_runes(const glyph_spec * specs, int n, const cell_attr & a) {
+  // Dirty glyphs next to each other emit particles as one source
+  for (int i = 0; i < n;) {
+    if (!specs[i].dirty) {
+      ++i;
+      continue;
+    }
+    int end = i + 1;
+    while (end < n && specs[end].dirty) {
+      ++end;
+    }
+    _effects.add_source(specs[i].x, specs[end - 1].x, specs[i].y, end - i);
+    i = end;
+  }
+
+  int i = 0;
+  while (i < n) {
+    // Runs mostly come from a single font, look its vertices up once
+    struct atlas * font = specs[i].font;
+    int end = i + 1;
+    while (end < n && specs[end].font == font) {
+      ++end;
+    }
+    if (!font) {
+      for (; i < end; ++i) {
+        render_placeholder(specs + i, a);
+      }
+      continue;
+    }
+    auto & verts = _target->glyphs[font];
+    verts.reserve(verts.size() + 6 * (end - i));
+    for (; i < end; ++i) {
+      glyph_vertices(specs + i, a, verts);
+    }
+  }
+}
+
+void render_context::set_clear_color(const color & c) {
+  _clear_color = c;
+}
+
+void render_context::set_size(int w, int h) {
+  _win_w = w;
+  _win_h = h;
+  if (_retain_scene) {
+    _targets.fit(_fb, w, h);
+    if (!_fb_blitter) {
+      _fb_blitter.reset(new FBBlitJob(std::make_shared<GlShader>(std::string(vert_shader), std::string(framebuffer_frag_shader))));
+    }
+  }
+  _effects.set_size(w, h);
+}
+
+void render_context::set_y_nudge(int y) {
+  printf("Y nudged %d\n", y);
+}
+
+void render_context::on_key_press(const TCursor & c, const char * const buf, int buflen) {
+  _effects.on_key_press(c);
+}
+
 render_context::render_context()
-  : _shader(std::string(vert_shader), std::string(frag_shader)),
-    _fb(new GlFrameBuffer(1, 1, false, GL_DEPTH_COMPONENT24)),
-    _particle_fb(new GlFrameBuffer(1, 1, false, GL_DEPTH_COMPONENT24)),
+  : _shader(cell_shader_source(cell_vert_shader), std::string(frag_shader)),
+    _retain_scene(false),
+    _color_shader(std::make_shared<GlShader>(std::string(vert_shader), std::string(color_shader))),
+    _cell_color_shader(std::make_shared<GlShader>(cell_shader_source(cell_vert_shader), std::string(color_shader))),
+    _grid_shader(std::make_shared<GlShader>(std::string(vert_shader), cell_shader_source(cell_grid_frag_shader))),
+    _screens{{_color_shader, _cell_color_shader, _grid_shader},
+             {_color_shader, _cell_color_shader, _grid_shader}},
+    _screen(0),
+    _overlay(_color_shader, _cell_color_shader, _grid_shader),
+    _target(&_overlay.begin_row(0)),
+    _target_overlay(true),
+    _metrics(),
     _win_w(1),
     _win_h(1),
-    _parts(basic_update, 16.f),
-    _time_since_keypress(10000.f),
-    _rotation(0.f),
-    _jounce(0.f),
-    _jounce_factor(0.f),
-    _fb_blitter(std::make_shared<GlShader>(std::string(vert_shader), std::string(framebuffer_frag_shader))),
-    _particle_blitter(std::make_shared<GlShader>(std::string(vert_shader), std::string(particle_blit_shader))),
-    _rect_job(std::make_shared<GlShader>(std::string(vert_shader), std::string(color_shader)))
+    _effects(_targets)
 {
   glEnable(GL_FRAMEBUFFER_SRGB);
 }
@@ -1190,7 +3246,13 @@ render_context::render_context()
 // External function implementation
 ////////////////////////////////////////////////////////////////////////////////
 struct render_context * render_init() {
-  return new render_context();
+  struct render_context * rc = new render_context();
+  if (getenv("STGL_STARTUP_TIMING")) {
+    printf("Shader programs: %d cached in %.1f ms, %d compiled in %.1f ms\n",
+           program_stats.loaded, program_stats.load_ms,
+           program_stats.compiled, program_stats.compile_ms);
+  }
+  return rc;
 }
 
 void render_destroy(struct render_context * rc) {
@@ -1214,6 +3276,18 @@ void render_do_render(struct render_context * rc) {
   rc->do_render();
 }
 
+bool render_animating(struct render_context * rc) {
+  return rc->_effects.animating();
+}
+
+int render_effect_tier(struct render_context * rc) {
+  return rc->_effects.tier();
+}
+
+const char * render_frame_passes(struct render_context * rc) {
+  return rc->describe_passes();
+}
+
 struct atlas * atlas_create_from_face(FT_Face f) {
   return new atlas(f);
 }
@@ -1229,8 +3303,12 @@ struct atlas * atlas_create_from_pattern(FT_Library lib, FcPattern * pat, FT_UIn
     fputs("st: failed to get font index\n", stderr);
     return nullptr;
   }
+  return atlas_create_from_file(lib, file_name, file_index, size);
+}
+
+struct atlas * atlas_create_from_file(FT_Library lib, const char * file, int index, FT_UInt size) {
   FT_Face f;
-  if (FT_New_Face(lib, file_name, file_index, &f) != 0) {
+  if (FT_New_Face(lib, file, index, &f) != 0) {
     fputs("st: failed to open font file\n", stderr);
     return nullptr;
   }
@@ -1249,12 +3327,51 @@ FT_Face atlas_get_face(struct atlas * a) {
   return a->face;
 }
 
-void render_rune(struct render_context * rc, const struct glyph_spec * spec) {
-  rc->render_rune(spec);
+size_t atlas_memory(struct atlas * a) {
+  return (size_t)ATLAS_SIZE * ATLAS_SIZE
+    + a->dense.capacity() * sizeof(struct glyph_render_params)
+    + a->dense_loaded.capacity() / 8
+    + a->uvs.size() * (sizeof(FT_UInt) + sizeof(struct glyph_render_params) + 2 * sizeof(void*));
+}
+
+void render_forget_atlas(struct render_context * rc, struct atlas * a) {
+  rc->forget_atlas(a);
+}
+
+void render_set_palette(struct render_context * rc, const struct color * colors, int n, uint32_t defaultfg, uint32_t defaultbg) {
+  rc->_palette.set_colors(colors, n, defaultfg, defaultbg);
+}
+
+void render_set_modes(struct render_context * rc, uint32_t modes) {
+  rc->_palette.set_modes(modes);
+}
+
+void render_runes(struct render_context * rc, const struct glyph_spec * specs, int n, const struct cell_attr * a) {
+  rc->render_runes(specs, n, *a);
+}
+
+void render_cells(struct render_context * rc, const struct cell_attr * a, int col, int row, int n) {
+  rc->render_cells(*a, col, row, n);
 }
 
 void render_rect(struct render_context * rc, const struct color * const c, int x, int y, int w, int h) {
-  rc->_rect_job.draw_rect(c, x, y, w, h);
+  rc->render_rect(c, x, y, w, h);
+}
+
+void render_begin_row(struct render_context * rc, int row) {
+  rc->begin_row(row);
+}
+
+void render_begin_overlay(struct render_context * rc) {
+  rc->begin_overlay();
+}
+
+void render_set_grid(struct render_context * rc, int cols, int rows, const struct cell_metrics * m) {
+  rc->set_grid(cols, rows, *m);
+}
+
+void render_set_screen(struct render_context * rc, int alt) {
+  rc->set_screen(alt);
 }
 
 void render_send_keypress(struct render_context * rc, const TCursor c, const char * const buf, const int buf_len) {
@@ -24,9 +24,34 @@ extern "C" {
       a->a == b->a;
   }
 
+  /** Number of indexed colours the renderer keeps */
+  #define RENDER_PALETTE_SIZE 512
+
+  /** Colours and attributes of a run as stored in the terminal. Indexed
+   * and truecolor values, bold promotion, reverse, faint, blink and
+   * invisible are resolved against the palette on the GPU */
+  struct cell_attr {
+    uint32_t fg, bg, mode;
+  };
+
+  /** Placement of the cell grid in the window, in pixels */
+  struct cell_metrics {
+    int x, y;          /* top left corner of the first cell */
+    int w, h;          /* size of a cell */
+    int baseline;      /* line of a cell glyphs are placed on */
+    int underline;     /* line of a cell the underline is drawn on */
+    int strike;        /* line of a cell the strikethrough is drawn on */
+  };
+
+  /** Terminal wide modes applied when resolving cell colours */
+  enum render_mode {
+    RENDER_REVERSE = 1 << 0,
+    RENDER_BLINK   = 1 << 1,
+  };
+
   struct glyph_spec {
     FT_UInt glyph;
-    struct color * c;
+    /** NULL while the font is not known yet, a placeholder box is drawn */
     struct atlas * font;
     bool dirty;
     int x, y;
@@ -40,6 +65,15 @@ extern "C" {
   struct render_context * render_init(void);
   void render_destroy(struct render_context * rc);
   void render_do_render(struct render_context * rc);
+  /** Whether effects still move, so frames are worth drawing without any
+   * change to the terminal */
+  bool render_animating(struct render_context * rc);
+  /** Effect quality the frame times allow, 0 for all effects. Higher tiers
+   * spawn fewer particles, draw them coarser and drop the jounce */
+  int render_effect_tier(struct render_context * rc);
+  /** Names of the passes the last frame ran, separated by spaces. Valid
+   * until the next call */
+  const char * render_frame_passes(struct render_context * rc);
   void render_resize(struct render_context * rc, int w, int h);
   void render_set_y_nudge(struct render_context * rc, int nudge);
   void render_set_clear_color(struct render_context * rc, struct color * c);
@@ -48,12 +82,42 @@ extern "C" {
   /** Create an atlas. Takes ownership of the font */
   struct atlas * atlas_create_from_face(FT_Face f);
   struct atlas * atlas_create_from_pattern(FT_Library lib, FcPattern * pat, FT_UInt size);
+  struct atlas * atlas_create_from_file(FT_Library lib, const char * file, int index, FT_UInt size);
   /** Destroy an atlas. Second parameter is true if we should also destroy the face */
   void atlas_destroy(struct atlas * a, bool);
   FT_Face atlas_get_face(struct atlas * a);
+  /** Bytes the atlas holds, its texture and glyph tables */
+  size_t atlas_memory(struct atlas * a);
+  /** Drops all geometry drawn with a, which must be done before it is
+   * destroyed. Rows that used it show no glyphs until drawn again */
+  void render_forget_atlas(struct render_context * rc, struct atlas * a);
 
-  void render_rune(struct render_context * rc, const struct glyph_spec * spec);
+  /** Replaces the palette with n colours in linear space. Cells whose
+   * colour equals defaultfg or defaultbg are not inverted in reverse mode */
+  void render_set_palette(struct render_context * rc, const struct color * colors, int n, uint32_t defaultfg, uint32_t defaultbg);
+  /** Sets the render_mode flags used from the next frame on */
+  void render_set_modes(struct render_context * rc, uint32_t modes);
+
+  /** Draws a run of glyphs sharing the attributes a */
+  void render_runes(struct render_context * rc, const struct glyph_spec * specs, int n, const struct cell_attr * a);
+  /** Gives n cells from column col of row the background and decoration
+   * lines of a. Rows keep them in a texture of the screen, the overlay
+   * draws them as rectangles */
+  void render_cells(struct render_context * rc, const struct cell_attr * a, int col, int row, int n);
   void render_rect(struct render_context * rc, const struct color * const c, int x, int y, int w, int h);
+
+  /** Draw calls after this replace the retained geometry of the given row.
+   * Rows that are not begun again keep what they showed last frame */
+  void render_begin_row(struct render_context * rc, int row);
+  /** Draw calls after this only last for the current frame. This is the
+   * state after every render_do_render */
+  void render_begin_overlay(struct render_context * rc);
+  /** Sets the size and placement of the cell grid. A new size drops the
+   * rows past the end and empties the cells of every row */
+  void render_set_grid(struct render_context * rc, int cols, int rows, const struct cell_metrics * m);
+  /** Selects the primary (0) or alternate (1) screen. Each one keeps its
+   * own rows, so switching does not need anything to be drawn again */
+  void render_set_screen(struct render_context * rc, int alt);
 #ifdef __cplusplus
 }
 #endif
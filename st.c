@@ -50,6 +50,9 @@ char *argv0;
 #define ESC_ARG_SIZ   16
 #define STR_BUF_SIZ   ESC_BUF_SIZ
 #define STR_ARG_SIZ   ESC_ARG_SIZ
+#define STYLE_MAX     (USHRT_MAX + 1)
+#define BLANK_MAX     8
+#define STYLE_GCWAIT  4096
 
 /* macros */
 #define NUMMAXLEN(x)		((int)(sizeof(x) * 2.56 + 0.5) + 1)
@@ -58,6 +61,8 @@ char *argv0;
 #define ISCONTROLC1(c)		(BETWEEN(c, 0x80, 0x9f))
 #define ISCONTROL(c)		(ISCONTROLC0(c) || ISCONTROLC1(c))
 #define ISDELIM(u)		(utf8strchr(worddelimiters, u) != NULL)
+#define ISBLINK(c)		((term.styles[(c).style].mode & ATTR_BLINK) != 0)
+#define OWNED(y)		(term.line[term.row + (y)])
 
 /* constants */
 #define ISO14755CMD		"dmenu -w %lu -p codepoint: </dev/null"
@@ -180,8 +185,26 @@ static void tsetattr(int *, int);
 static void tsetchar(Rune, Glyph *, int, int);
 static void tsetscroll(int, int);
 static void tswapscreen(void);
+static void tswaplines(int, int);
+static int tcountblink(Line, int);
+static void tblinkrow(int);
+static int *tresizeblink(int *, Line *, int, int, int, int, int *);
+static void tdirtycols(int, int, int);
+static void tallocdirt(int, int);
+static Line *tallocscreen(Line *, int, int, int, int, int, Line);
+static void taltscreen(void);
+static int tblankidx(ushort);
+static void tblankcompact(void);
+static Line tblankrow(ushort);
+static void tmaterialize(int);
+static Line tslotget(void);
+static void tslotput(Line);
+static void tslotflush(void);
 static void tsetmode(int, int, int *, int);
 static void tfulldirt(void);
+static uint stylehash(const Style *);
+static void stylehashadd(uint);
+static void stylegc(void);
 static void techo(Rune);
 static void tcontrolcode(uchar );
 static void tdectest(char );
@@ -201,7 +224,6 @@ static size_t utf8validate(Rune *, size_t);
 static char *base64dec(const char *);
 
 static ssize_t xwrite(int, const char *, size_t);
-static void *xrealloc(void *, size_t);
 
 /* Globals */
 TermWindow win;
@@ -209,6 +231,8 @@ Term term;
 Selection sel;
 int cmdfd;
 pid_t pid;
+static volatile sig_atomic_t childexited;
+static int ttyhup;
 char **opt_cmd  = NULL;
 char *opt_class = NULL;
 char *opt_embed = NULL;
@@ -221,6 +245,30 @@ int oldbutton   = 3; /* button event on startup: 3 = release */
 
 static CSIEscape csiescseq;
 static STREscape strescseq;
+
+/* Lookup side of term.styles */
+static struct {
+	uint *hash;   /* open addressed, style index + 1, 0 when empty */
+	int hashlen;  /* slots in hash, a power of two */
+	int len;      /* styles in use */
+	int cap;      /* styles allocated */
+	int last;     /* most recently interned style */
+	int gcwait;   /* misses to take before collecting again */
+} styletab;
+
+/* Shared rows of blanks, one per style, see tblankrow() */
+static struct {
+	Cell *rows;   /* BLANK_MAX rows of term.col cells */
+	ushort style[BLANK_MAX];
+	int len;
+} blanks;
+
+/* Row slots no row owns anymore, see tslotget() */
+static struct {
+	Line *free;   /* spare slots of term.col cells */
+	int len;
+	int cap;
+} slots;
 static int iofd = 1;
 
 char *usedfont = NULL;
@@ -238,6 +286,7 @@ size_t colornamelen = LEN(colorname);
 size_t mshortcutslen = LEN(mshortcuts);
 size_t shortcutslen = LEN(shortcuts);
 size_t selmaskslen = LEN(selmasks);
+size_t fallbackwarmlen = LEN(fallbackwarm);
 
 ssize_t
 xwrite(int fd, const char *s, size_t len)
@@ -496,16 +545,34 @@ selnormalize(void)
 int
 selected(int x, int y)
 {
+	int x1, x2;
+
 	if (sel.mode == SEL_EMPTY)
 		return 0;
 
-	if (sel.type == SEL_RECTANGULAR)
-		return BETWEEN(y, sel.nb.y, sel.ne.y)
-		    && BETWEEN(x, sel.nb.x, sel.ne.x);
+	return selspan(y, &x1, &x2) && BETWEEN(x, x1, x2);
+}
+
+/*
+ * Stores the columns of row y covered by the normalized selection in
+ * *x1..*x2. Returns 0 if the row is outside of it, so callers can test a
+ * whole row at once instead of every cell.
+ */
+int
+selspan(int y, int *x1, int *x2)
+{
+	if (!BETWEEN(y, sel.nb.y, sel.ne.y))
+		return 0;
+
+	if (sel.type == SEL_RECTANGULAR) {
+		*x1 = sel.nb.x;
+		*x2 = sel.ne.x;
+	} else {
+		*x1 = (y == sel.nb.y) ? sel.nb.x : 0;
+		*x2 = (y == sel.ne.y) ? sel.ne.x : term.col - 1;
+	}
 
-	return BETWEEN(y, sel.nb.y, sel.ne.y)
-	    && (y != sel.nb.y || x >= sel.nb.x)
-	    && (y != sel.ne.y || x <= sel.ne.x);
+	return *x1 <= *x2;
 }
 
 void
@@ -513,7 +580,7 @@ selsnap(int *x, int *y, int direction)
 {
 	int newx, newy, xt, yt;
 	int delim, prevdelim;
-	Glyph *gp, *prevgp;
+	Cell *gp, *prevgp;
 
 	switch (sel.snap) {
 	case SNAP_WORD:
@@ -585,8 +652,8 @@ char *
 getsel(void)
 {
 	char *str, *ptr;
-	int y, bufsize, lastx, linelen;
-	Glyph *gp, *last;
+	int y, bufsize, firstx, lastx, linelen;
+	Cell *gp, *last;
 
 	if (sel.ob.x == -1)
 		return NULL;
@@ -601,13 +668,8 @@ getsel(void)
 			continue;
 		}
 
-		if (sel.type == SEL_RECTANGULAR) {
-			gp = &term.line[y][sel.nb.x];
-			lastx = sel.ne.x;
-		} else {
-			gp = &term.line[y][sel.nb.y == y ? sel.nb.x : 0];
-			lastx = (sel.ne.y == y) ? sel.ne.x : term.col-1;
-		}
+		selspan(y, &firstx, &lastx);
+		gp = &term.line[y][firstx];
 		last = &term.line[y][MIN(lastx, linelen-1)];
 		while (last >= gp && last->u == ' ')
 			--last;
@@ -720,21 +782,42 @@ execsh(void)
 	_exit(1);
 }
 
+/*
+ * Only notes that a child exited, ttyexited() reaps it outside of the
+ * signal handler.
+ */
 void
 sigchld(int a)
+{
+	childexited = 1;
+}
+
+/*
+ * Returns 1 once the shell exited successfully, dies if it failed or the
+ * tty was hung up while the shell is still running.
+ */
+int
+ttyexited(void)
 {
 	int stat;
 	pid_t p;
 
+	if (!childexited && !ttyhup)
+		return 0;
+	childexited = 0;
+
 	if ((p = waitpid(pid, &stat, WNOHANG)) < 0)
 		die("Waiting for pid %hd failed: %s\n", pid, strerror(errno));
 
-	if (pid != p)
-		return;
+	if (pid != p) {
+		if (ttyhup)
+			die("Couldn't read from shell: %s\n", strerror(EIO));
+		return 0;
+	}
 
 	if (!WIFEXITED(stat) || WEXITSTATUS(stat))
 		die("child finished with error '%d'\n", stat);
-	exit(0);
+	return 1;
 }
 
 
@@ -825,8 +908,14 @@ ttyread(void)
 	int ret;
 
 	/* append read bytes to unprocessed bytes */
-	if ((ret = read(cmdfd, buf+buflen, LEN(buf)-buflen)) < 0)
+	if ((ret = read(cmdfd, buf+buflen, LEN(buf)-buflen)) < 0) {
+		/* the shell closed the tty, see ttyexited() */
+		if (errno == EIO) {
+			ttyhup = 1;
+			return 0;
+		}
 		die("Couldn't read from shell: %s\n", strerror(errno));
+	}
 
 	buflen += ret;
 	ptr = buf;
@@ -956,9 +1045,12 @@ tattrset(int attr)
 {
 	int i, j;
 
+	if (attr == ATTR_BLINK)
+		return term.nblink > 0;
+
 	for (i = 0; i < term.row-1; i++) {
 		for (j = 0; j < term.col-1; j++) {
-			if (term.line[i][j].mode & attr)
+			if (CELLMODE(term.line[i][j]) & attr)
 				return 1;
 		}
 	}
@@ -969,20 +1061,91 @@ tattrset(int attr)
 void
 tsetdirt(int top, int bot, int left, int right)
 {
-	int i, j;
+	int i;
 
 	LIMIT(top, 0, term.row-1);
 	LIMIT(bot, 0, term.row-1);
   LIMIT(left, 0, term.col - 1);
   LIMIT(right, 0, term.col - 1);
 
-	for (i = top; i <= bot; i++) {
-    term.per_row_dirty[i] += right - left + 1;
-    for (j = left; j <= right; ++j) {
-      term.dirty_this_frame++;
-      term.dirty[i][j] = 1;
-    }
-  }
+	for (i = top; i <= bot; i++)
+		tdirtycols(i, left, right);
+}
+
+/*
+ * Marks columns x1..x2 of row y dirty. A full-width span is a handful of
+ * word stores.
+ */
+void
+tdirtycols(int y, int x1, int x2)
+{
+	DirtyRow *d = &term.dirty[y];
+	uint64_t lo = ~(uint64_t)0 << (x1 % 64);
+	uint64_t hi = ~(uint64_t)0 >> (63 - x2 % 64);
+	int w;
+
+	if (x1 / 64 == x2 / 64) {
+		d->bits[x1 / 64] |= lo & hi;
+	} else {
+		d->bits[x1 / 64] |= lo;
+		for (w = x1 / 64 + 1; w < x2 / 64; w++)
+			d->bits[w] = ~(uint64_t)0;
+		d->bits[x2 / 64] |= hi;
+	}
+	d->min = MIN(d->min, x1);
+	d->max = MAX(d->max, x2);
+	term.dirtyrows[y / 64] |= (uint64_t)1 << (y % 64);
+}
+
+int
+tdirtycount(int y)
+{
+	DirtyRow *d = &term.dirty[y];
+	int w, n = 0;
+
+	if (d->min > d->max)
+		return 0;
+	for (w = d->min / 64; w <= d->max / 64; w++)
+		n += __builtin_popcountll(d->bits[w]);
+
+	return n;
+}
+
+void
+tcleandirt(int y)
+{
+	DirtyRow *d = &term.dirty[y];
+
+	if (d->min > d->max)
+		return;
+	memset(d->bits + d->min / 64, 0,
+			(d->max / 64 - d->min / 64 + 1) * sizeof(uint64_t));
+	d->min = term.col;
+	d->max = -1;
+	term.dirtyrows[y / 64] &= ~((uint64_t)1 << (y % 64));
+}
+
+/*
+ * Allocates the dirty bitsets of every row, plus the row bitmap, in a
+ * single clean block.
+ */
+void
+tallocdirt(int col, int row)
+{
+	int i, words = DIVCEIL(col, 64);
+	uint64_t *bits;
+
+	free(term.dirty);
+	term.dirty = xmalloc(row * sizeof(DirtyRow) +
+			(row * words + DIVCEIL(row, 64)) * sizeof(uint64_t));
+	bits = (uint64_t *)(term.dirty + row);
+	memset(bits, 0, (row * words + DIVCEIL(row, 64)) * sizeof(uint64_t));
+	for (i = 0; i < row; i++) {
+		term.dirty[i].bits = bits + i * words;
+		term.dirty[i].min = col;
+		term.dirty[i].max = -1;
+	}
+	term.dirtyrows = bits + row * words;
 }
 
 void
@@ -991,8 +1154,10 @@ tsetdirtattr(int attr)
 	int i, j;
 
 	for (i = 0; i < term.row-1; i++) {
+		if (attr == ATTR_BLINK && !term.blink[i])
+			continue;
 		for (j = 0; j < term.col-1; j++) {
-			if (term.line[i][j].mode & attr) {
+			if (CELLMODE(term.line[i][j]) & attr) {
 				tsetdirt(i, i, j, j);
 				break;
 			}
@@ -1031,6 +1196,10 @@ treset(void)
 		.bg = defaultbg
 	}, .x = 0, .y = 0, .state = CURSOR_DEFAULT};
 
+	/* make sure term.line is the main screen before dropping the mode */
+	if (IS_SET(MODE_ALTSCREEN))
+		tswapscreen();
+
 	memset(term.tabs, 0, term.col * sizeof(*term.tabs));
 	for (i = tabspaces; i < term.col; i += tabspaces)
 		term.tabs[i] = 1;
@@ -1043,7 +1212,8 @@ treset(void)
 	for (i = 0; i < 2; i++) {
 		tmoveto(0, 0);
 		tcursor(CURSOR_SAVE);
-		tclearregion(0, 0, term.col-1, term.row-1);
+		if (term.line)
+			tclearregion(0, 0, term.col-1, term.row-1);
 		tswapscreen();
 	}
 }
@@ -1062,29 +1232,305 @@ void
 tswapscreen(void)
 {
 	Line *tmp = term.line;
+	int *blink = term.blink;
+	int nblink = term.nblink;
 
 	term.line = term.alt;
 	term.alt = tmp;
+	term.blink = term.altblink;
+	term.altblink = blink;
+	term.nblink = term.altnblink;
+	term.altnblink = nblink;
 	term.mode ^= MODE_ALTSCREEN;
-	tfulldirt();
+}
+
+/*
+ * Allocates the row views of a screen followed by the slot each row
+ * owns (see OWNED()). A row sharing a blank row has no slot until
+ * tmaterialize() gives it one.
+ *
+ * Rows not carried over share fill, or get a slot the caller has to
+ * clear if fill is NULL. The minrow x mincol corner of old, starting at
+ * row off, is carried over and old is freed along with its slots. Old is
+ * laid out for term.row rows; its blank rows are shared again from
+ * blanks, which must already be col wide.
+ */
+Line *
+tallocscreen(Line *old, int col, int row, int off, int mincol, int minrow,
+		Line fill)
+{
+	Line *rows;
+	int i, carry;
+
+	rows = xmalloc(2 * row * sizeof(Line));
+	for (i = 0; i < row; i++) {
+		carry = old && i < minrow;
+		if (carry && old[i + off] != old[term.row + i + off]) {
+			rows[i] = blanks.rows + col *
+				tblankidx(old[i + off][0].style);
+			rows[row + i] = NULL;
+		} else if (carry || !fill) {
+			rows[i] = rows[row + i] = xmalloc(col * sizeof(Cell));
+			if (carry)
+				memcpy(rows[i], old[i + off], mincol * sizeof(Cell));
+		} else {
+			rows[i] = fill;
+			rows[row + i] = NULL;
+		}
+	}
+
+	if (old) {
+		for (i = 0; i < term.row; i++)
+			free(old[term.row + i]);
+		free(old);
+	}
+
+	return rows;
+}
+
+int
+tblankidx(ushort style)
+{
+	int i;
+
+	for (i = 0; i < blanks.len; i++) {
+		if (blanks.style[i] == style)
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Drops the shared blank rows no row of either screen points to anymore
+ * and moves the rest to the front of blanks.
+ */
+void
+tblankcompact(void)
+{
+	Line *screens[] = { term.line, term.alt };
+	int remap[BLANK_MAX], i, n, y;
+
+	for (i = 0; i < BLANK_MAX; i++)
+		remap[i] = -1;
+	for (i = 0; i < LEN(screens); i++) {
+		if (!screens[i])
+			continue;
+		for (y = 0; y < term.row; y++) {
+			if (screens[i][y] != screens[i][term.row + y])
+				remap[(screens[i][y] - blanks.rows) / term.col] = 0;
+		}
+	}
+
+	for (i = n = 0; i < blanks.len; i++) {
+		if (remap[i] < 0)
+			continue;
+		if (i != n) {
+			memcpy(blanks.rows + n * term.col,
+					blanks.rows + i * term.col,
+					term.col * sizeof(Cell));
+			blanks.style[n] = blanks.style[i];
+		}
+		remap[i] = n++;
+	}
+	if (n == blanks.len)
+		return;
+	blanks.len = n;
+
+	for (i = 0; i < LEN(screens); i++) {
+		if (!screens[i])
+			continue;
+		for (y = 0; y < term.row; y++) {
+			if (screens[i][y] == screens[i][term.row + y])
+				continue;
+			screens[i][y] = blanks.rows + term.col *
+				remap[(screens[i][y] - blanks.rows) / term.col];
+		}
+	}
+}
+
+/*
+ * Returns the shared row of blanks with the given style, or NULL if
+ * all of them are still in use. Such rows are read-only, tmaterialize()
+ * has to be called before a row is written to.
+ */
+Line
+tblankrow(ushort style)
+{
+	Cell blank = { .u = ' ', .style = style };
+	Line row;
+	int i;
+
+	if ((i = tblankidx(style)) >= 0)
+		return blanks.rows + i * term.col;
+	if (blanks.len == BLANK_MAX)
+		tblankcompact();
+	if (blanks.len == BLANK_MAX)
+		return NULL;
+
+	row = blanks.rows + blanks.len * term.col;
+	for (i = 0; i < term.col; i++)
+		row[i] = blank;
+	blanks.style[blanks.len++] = style;
+
+	return row;
+}
+
+/*
+ * Gives row y its own cells if it is sharing a blank row.
+ */
+void
+tmaterialize(int y)
+{
+	if (term.line[y] == OWNED(y))
+		return;
+	OWNED(y) = tslotget();
+	memcpy(OWNED(y), term.line[y], term.col * sizeof(Cell));
+	term.line[y] = OWNED(y);
+}
+
+/*
+ * Returns a slot of term.col cells for a row to own, reusing one a
+ * cleared row gave back if there is any.
+ */
+Line
+tslotget(void)
+{
+	if (slots.len > 0)
+		return slots.free[--slots.len];
+
+	return xmalloc(term.col * sizeof(Cell));
+}
+
+/*
+ * Takes back the slot of a row that shares a blank row again. Up to a
+ * screen's worth is kept for reuse, the rest is freed.
+ */
+void
+tslotput(Line slot)
+{
+	if (slots.len == term.row) {
+		free(slot);
+		return;
+	}
+	if (slots.len == slots.cap) {
+		slots.cap = MAX(2 * slots.cap, 16);
+		slots.free = xrealloc(slots.free, slots.cap * sizeof(Line));
+	}
+	slots.free[slots.len++] = slot;
+}
+
+/*
+ * Frees the spare slots, which no longer fit once term.col changes.
+ */
+void
+tslotflush(void)
+{
+	while (slots.len > 0)
+		free(slots.free[--slots.len]);
+}
+
+/*
+ * The alternate screen is only materialized the first time it is
+ * entered; until then term.alt is NULL.
+ */
+void
+taltscreen(void)
+{
+	Glyph attr = { .fg = defaultfg, .bg = defaultbg };
+	Cell blank = { .u = ' ' };
+	Line row;
+	int x, y;
+
+	if (term.alt)
+		return;
+
+	blank.style = styleintern(&attr);
+	row = tblankrow(blank.style);
+	term.alt = tallocscreen(NULL, term.col, term.row, 0, 0, 0, row);
+	for (y = 0; !row && y < term.row; y++) {
+		for (x = 0; x < term.col; x++)
+			term.alt[y][x] = blank;
+	}
+	term.altblink = xmalloc(term.row * sizeof(*term.altblink));
+	memset(term.altblink, 0, term.row * sizeof(*term.altblink));
+	term.altnblink = 0;
+}
+
+void
+tswaplines(int a, int b)
+{
+	Line line = term.line[a];
+	Line own = OWNED(a);
+	int blink = term.blink[a];
+
+	term.line[a] = term.line[b];
+	term.line[b] = line;
+	OWNED(a) = OWNED(b);
+	OWNED(b) = own;
+	term.blink[a] = term.blink[b];
+	term.blink[b] = blink;
+}
+
+int
+tcountblink(Line line, int len)
+{
+	int x, n = 0;
+
+	for (x = 0; x < len; x++)
+		n += ISBLINK(line[x]);
+
+	return n;
+}
+
+/*
+ * Recounts the blinking cells of row y after a bulk change to it.
+ */
+void
+tblinkrow(int y)
+{
+	int n = tcountblink(term.line[y], term.col);
+
+	term.nblink += n - term.blink[y];
+	term.blink[y] = n;
+}
+
+/*
+ * Carries the blink counts of a screen over a resize, the same way
+ * tallocscreen() carries its cells. Only the rows that had blinking
+ * cells need to be counted again.
+ */
+int *
+tresizeblink(int *old, Line *screen, int row, int off, int mincol,
+		int minrow, int *total)
+{
+	int *blink = xmalloc(row * sizeof(*blink));
+	int y;
+
+	*total = 0;
+	for (y = 0; y < row; y++) {
+		blink[y] = 0;
+		if (y < minrow && old[y + off])
+			blink[y] = tcountblink(screen[y], mincol);
+		*total += blink[y];
+	}
+	free(old);
+
+	return blink;
 }
 
 void
 tscrolldown(int orig, int n)
 {
 	int i;
-	Line temp;
 
 	LIMIT(n, 0, term.bot-orig+1);
 
 	tsetdirt(orig, term.bot-n, 0, term.col-1);
 	tclearregion(0, term.bot-n+1, term.col-1, term.bot);
 
-	for (i = term.bot; i >= orig+n; i--) {
-		temp = term.line[i];
-		term.line[i] = term.line[i-n];
-		term.line[i-n] = temp;
-	}
+	for (i = term.bot; i >= orig+n; i--)
+		tswaplines(i, i-n);
 
 	selscroll(orig, n);
 }
@@ -1093,18 +1539,14 @@ void
 tscrollup(int orig, int n)
 {
 	int i;
-	Line temp;
 
 	LIMIT(n, 0, term.bot-orig+1);
 
 	tclearregion(0, orig, term.col-1, orig+n-1);
 	tsetdirt(orig+n, term.bot, 0, term.col-1);
 
-	for (i = orig; i <= term.bot-n; i++) {
-		temp = term.line[i];
-		term.line[i] = term.line[i+n];
-		term.line[i+n] = temp;
-	}
+	for (i = orig; i <= term.bot-n; i++)
+		tswaplines(i, i+n);
 
 	selscroll(orig, -n);
 }
@@ -1206,6 +1648,170 @@ tmoveto(int x, int y)
 	term.c.y = LIMIT(y, miny, maxy);
 }
 
+uint
+stylehash(const Style *s)
+{
+	uint h;
+
+	h = s->fg * 0x9e3779b1u;
+	h ^= s->bg * 0x85ebca6bu;
+	h ^= s->mode * 0xc2b2ae35u;
+
+	return h ^ (h >> 15);
+}
+
+void
+stylehashadd(uint i)
+{
+	uint h = stylehash(&term.styles[i]);
+
+	while (styletab.hash[h & (styletab.hashlen - 1)])
+		h++;
+	styletab.hash[h & (styletab.hashlen - 1)] = i + 1;
+}
+
+/*
+ * Returns the index of the style holding the colors and rendition flags
+ * of g, adding it to term.styles if it is not there yet. Style 0 is the
+ * default colors; it never moves and stands in when the table is full.
+ */
+ushort
+styleintern(const Glyph *g)
+{
+	static int warned;
+	Style s = { .fg = g->fg, .bg = g->bg, .mode = g->mode & ~ATTR_LAYOUT };
+	Style *sp;
+	uint i;
+
+	if (styletab.len == 0) {
+		styletab.cap = 64;
+		term.styles = xrealloc(term.styles,
+				styletab.cap * sizeof(*term.styles));
+		term.styles[0] = (Style){ .fg = defaultfg, .bg = defaultbg };
+		styletab.len = 1;
+	}
+	sp = &term.styles[styletab.last];
+	if (sp->fg == s.fg && sp->bg == s.bg && sp->mode == s.mode)
+		return styletab.last;
+
+	if (2 * (styletab.len + 1) > styletab.hashlen) {
+		free(styletab.hash);
+		styletab.hashlen = MAX(2 * styletab.hashlen, 64);
+		styletab.hash = xmalloc(styletab.hashlen * sizeof(uint));
+		memset(styletab.hash, 0, styletab.hashlen * sizeof(uint));
+		for (i = 0; i < styletab.len; i++)
+			stylehashadd(i);
+	}
+
+	for (i = stylehash(&s) & (styletab.hashlen - 1);
+			styletab.hash[i]; i = (i + 1) & (styletab.hashlen - 1)) {
+		sp = &term.styles[styletab.hash[i] - 1];
+		if (sp->fg == s.fg && sp->bg == s.bg && sp->mode == s.mode)
+			return styletab.last = styletab.hash[i] - 1;
+	}
+
+	if (styletab.len == STYLE_MAX) {
+		/* a collection that freed nothing is not retried right away */
+		if (styletab.gcwait > 0) {
+			styletab.gcwait--;
+		} else {
+			stylegc();
+			if (styletab.len == STYLE_MAX)
+				styletab.gcwait = STYLE_GCWAIT;
+		}
+		if (styletab.len == STYLE_MAX) {
+			if (!warned)
+				fprintf(stderr, "styleintern: style table full\n");
+			warned = 1;
+			return 0;
+		}
+		/* the styles were renumbered, find the free slot again */
+		for (i = stylehash(&s) & (styletab.hashlen - 1);
+				styletab.hash[i];
+				i = (i + 1) & (styletab.hashlen - 1))
+			;
+	}
+	if (styletab.len == styletab.cap) {
+		styletab.cap = MIN(MAX(2 * styletab.cap, 64), STYLE_MAX);
+		term.styles = xrealloc(term.styles,
+				styletab.cap * sizeof(*term.styles));
+	}
+	term.styles[styletab.len] = s;
+	styletab.hash[i] = ++styletab.len;
+
+	return styletab.last = styletab.len - 1;
+}
+
+/*
+ * Drops the styles no cell refers to anymore and renumbers the rest,
+ * leaving the default style at index 0.
+ */
+void
+stylegc(void)
+{
+	ushort *remap;
+	Line *screens[] = { term.line, term.alt };
+	uint i, n;
+	int x, y;
+
+	/* blank rows nothing shows anymore do not keep their style alive */
+	tblankcompact();
+	remap = xmalloc(STYLE_MAX * sizeof(*remap));
+	memset(remap, 0, STYLE_MAX * sizeof(*remap));
+	remap[0] = 1;
+	for (i = 0; i < blanks.len; i++)
+		remap[blanks.style[i]] = 1;
+	for (i = 0; i < LEN(screens); i++) {
+		if (!screens[i])
+			continue;
+		for (y = 0; y < term.row; y++) {
+			/* shared rows are covered by the blanks above */
+			if (screens[i][y] != screens[i][term.row + y])
+				continue;
+			for (x = 0; x < term.col; x++)
+				remap[screens[i][y][x].style] = 1;
+		}
+	}
+
+	memset(styletab.hash, 0, styletab.hashlen * sizeof(uint));
+	for (i = n = 0; i < styletab.len; i++) {
+		if (!remap[i])
+			continue;
+		term.styles[n] = term.styles[i];
+		remap[i] = n;
+		stylehashadd(n++);
+	}
+	styletab.len = n;
+	styletab.last = 0;
+
+	for (i = 0; i < blanks.len * term.col; i++)
+		blanks.rows[i].style = remap[blanks.rows[i].style];
+	for (i = 0; i < blanks.len; i++)
+		blanks.style[i] = remap[blanks.style[i]];
+	for (i = 0; i < LEN(screens); i++) {
+		if (!screens[i])
+			continue;
+		for (y = 0; y < term.row; y++) {
+			if (screens[i][y] != screens[i][term.row + y])
+				continue;
+			for (x = 0; x < term.col; x++) {
+				screens[i][y][x].style =
+					remap[screens[i][y][x].style];
+			}
+		}
+	}
+	free(remap);
+}
+
+Glyph
+cellglyph(Cell c)
+{
+	Style *s = &term.styles[c.style];
+
+	return (Glyph){ .u = c.u, .mode = s->mode | c.mode,
+	                .fg = s->fg, .bg = s->bg };
+}
+
 void
 tsetchar(Rune u, Glyph *attr, int x, int y)
 {
@@ -1219,6 +1825,7 @@ tsetchar(Rune u, Glyph *attr, int x, int y)
 		"⎻", "─", "⎼", "⎽", "├", "┤", "┴", "┬", /* p - w */
 		"│", "≤", "≥", "π", "≠", "£", "·", /* x - ~ */
 	};
+	int n;
 
 	/*
 	 * The table is proudly stolen from rxvt.
@@ -1227,6 +1834,7 @@ tsetchar(Rune u, Glyph *attr, int x, int y)
 	   BETWEEN(u, 0x41, 0x7e) && vt100_0[u - 0x41])
 		utf8decode(vt100_0[u - 0x41], &u, UTF_SIZ);
 
+	tmaterialize(y);
 	if (term.line[y][x].mode & ATTR_WIDE) {
 		if (x+1 < term.col) {
 			term.line[y][x+1].u = ' ';
@@ -1238,19 +1846,25 @@ tsetchar(Rune u, Glyph *attr, int x, int y)
 	}
 
   if (term.line[y][x].u != u) {
-    term.per_row_dirty[y] += 1;
-    term.dirty_this_frame++;
-    term.dirty[y][x] = 1;
+    tdirtycols(y, x, x);
   }
-	term.line[y][x] = *attr;
+	if (ISBLINK(term.line[y][x]) != !!(attr->mode & ATTR_BLINK)) {
+		n = (attr->mode & ATTR_BLINK) ? 1 : -1;
+		term.blink[y] += n;
+		term.nblink += n;
+	}
 	term.line[y][x].u = u;
+	term.line[y][x].style = styleintern(attr);
+	term.line[y][x].mode = attr->mode & ATTR_LAYOUT;
 }
 
 void
 tclearregion(int x1, int y1, int x2, int y2)
 {
-	int x, y, temp;
-	Glyph *gp;
+	int x, y, temp, sx1, sx2;
+	Glyph attr = term.c.attr;
+	Cell blank = { .u = ' ' };
+	Line row;
 
 	if (x1 > x2)
 		temp = x1, x1 = x2, x2 = temp;
@@ -1262,19 +1876,30 @@ tclearregion(int x1, int y1, int x2, int y2)
 	LIMIT(y1, 0, term.row-1);
 	LIMIT(y2, 0, term.row-1);
 
+	attr.mode = 0;
+	blank.style = styleintern(&attr);
+	/* whole rows are cleared by pointing them to a shared blank row */
+	row = (x1 == 0 && x2 == term.col-1) ? tblankrow(blank.style) : NULL;
+
 	for (y = y1; y <= y2; y++) {
-    term.per_row_dirty[y] += x2 - x1 + 1;
-		for (x = x1; x <= x2; x++) {
-      term.dirty_this_frame++;
-      term.dirty[y][x] = 1;
-			gp = &term.line[y][x];
-			if (selected(x, y))
-				selclear();
-			gp->fg = term.c.attr.fg;
-			gp->bg = term.c.attr.bg;
-			gp->mode = 0;
-			gp->u = ' ';
+		tdirtycols(y, x1, x2);
+		if (sel.ob.x != -1 && sel.mode != SEL_EMPTY &&
+				selspan(y, &sx1, &sx2) && sx1 <= x2 && x1 <= sx2)
+			selclear();
+		if (row) {
+			if (OWNED(y))
+				tslotput(OWNED(y));
+			term.line[y] = row;
+			OWNED(y) = NULL;
+		} else if (term.line[y] == OWNED(y) ||
+				term.line[y][0].style != blank.style) {
+			tmaterialize(y);
+			for (x = x1; x <= x2; x++)
+				term.line[y][x] = blank;
 		}
+		/* blanks never blink, so only rows that did need a recount */
+		if (term.blink[y])
+			tblinkrow(y);
 	}
 }
 
@@ -1282,16 +1907,17 @@ void
 tdeletechar(int n)
 {
 	int dst, src, size;
-	Glyph *line;
+	Line line;
 
 	LIMIT(n, 0, term.col - term.c.x);
 
 	dst = term.c.x;
 	src = term.c.x + n;
 	size = term.col - src;
+	tmaterialize(term.c.y);
 	line = term.line[term.c.y];
 
-	memmove(&line[dst], &line[src], size * sizeof(Glyph));
+	memmove(&line[dst], &line[src], size * sizeof(Cell));
 	tclearregion(term.col-n, term.c.y, term.col-1, term.c.y);
 }
 
@@ -1299,16 +1925,17 @@ void
 tinsertblank(int n)
 {
 	int dst, src, size;
-	Glyph *line;
+	Line line;
 
 	LIMIT(n, 0, term.col - term.c.x);
 
 	dst = term.c.x + n;
 	src = term.c.x;
 	size = term.col - dst;
+	tmaterialize(term.c.y);
 	line = term.line[term.c.y];
 
-	memmove(&line[dst], &line[src], size * sizeof(Glyph));
+	memmove(&line[dst], &line[src], size * sizeof(Cell));
 	tclearregion(src, term.c.y, dst - 1, term.c.y);
 }
 
@@ -1574,8 +2201,10 @@ tsetmode(int priv, int set, int *args, int narg)
 					tclearregion(0, 0, term.col-1,
 							term.row-1);
 				}
-				if (set ^ alt) /* set is always 1 or 0 */
+				if (set ^ alt) { /* set is always 1 or 0 */
+					taltscreen();
 					tswapscreen();
+				}
 				if (*args != 1049)
 					break;
 				/* FALLTHROUGH */
@@ -1905,15 +2534,13 @@ strhandle(void)
 			/* FALLTHROUGH */
 		case 104: /* color reset, here p = NULL */
 			j = (narg > 1) ? atoi(strescseq.args[1]) : -1;
-			if (xsetcolorname(j, p)) {
+			/*
+			 * The renderer resolves cells against the palette,
+			 * so the next frame shows the change without any
+			 * row being drawn again.
+			 */
+			if (xsetcolorname(j, p))
 				fprintf(stderr, "erresc: invalid color %s\n", p);
-			} else {
-				/*
-				 * TODO if defaultbg color is changed, borders
-				 * are dirty
-				 */
-				redraw();
-			}
 			return;
 		}
 		break;
@@ -2062,7 +2689,7 @@ void
 tdumpline(int n)
 {
 	char buf[UTF_SIZ];
-	Glyph *bp, *end;
+	Cell *bp, *end;
 
 	bp = &term.line[n][0];
 	end = &bp[MIN(tlinelen(n), term.col) - 1];
@@ -2367,7 +2994,7 @@ tputc(Rune u)
 	char c[UTF_SIZ];
 	int control;
 	int width, len;
-	Glyph *gp;
+	Cell *gp;
 
 	control = ISCONTROL(u);
 	if (!IS_SET(MODE_UTF8) && !IS_SET(MODE_SIXEL)) {
@@ -2477,18 +3104,25 @@ check_control_code:
 	if (sel.ob.x != -1 && BETWEEN(term.c.y, sel.ob.y, sel.oe.y))
 		selclear();
 
+	tmaterialize(term.c.y);
 	gp = &term.line[term.c.y][term.c.x];
 	if (IS_SET(MODE_WRAP) && (term.c.state & CURSOR_WRAPNEXT)) {
 		gp->mode |= ATTR_WRAP;
 		tnewline(1);
+		tmaterialize(term.c.y);
 		gp = &term.line[term.c.y][term.c.x];
 	}
 
-	if (IS_SET(MODE_INSERT) && term.c.x+width < term.col)
-		memmove(gp+width, gp, (term.col - term.c.x - width) * sizeof(Glyph));
+	if (IS_SET(MODE_INSERT) && term.c.x+width < term.col) {
+		memmove(gp+width, gp, (term.col - term.c.x - width) * sizeof(Cell));
+		/* the cells pushed off the end may have been blinking */
+		if (term.blink[term.c.y])
+			tblinkrow(term.c.y);
+	}
 
 	if (term.c.x+width > term.col) {
 		tnewline(1);
+		tmaterialize(term.c.y);
 		gp = &term.line[term.c.y][term.c.x];
 	}
 
@@ -2515,6 +3149,11 @@ tresize(int col, int row)
 	int minrow = MIN(row, term.row);
 	int mincol = MIN(col, term.col);
 	int *bp;
+	int off;
+	Cell *oldblanks;
+	Line fill;
+	Glyph attr = { .fg = defaultfg, .bg = defaultbg };
+	ushort style;
 	TCursor c;
 
 	if (col < 1 || row < 1) {
@@ -2525,50 +3164,47 @@ tresize(int col, int row)
 
 	/*
 	 * slide screen to keep cursor where we expect it -
-	 * tscrollup would work here, but we can optimize to
-	 * memmove because we're freeing the earlier lines
+	 * tscrollup would work here, but we can just skip the
+	 * earlier lines while copying into the new arena
 	 */
-	for (i = 0; i <= term.c.y - row; i++) {
-		free(term.line[i]);
-		free(term.alt[i]);
-    free(term.dirty[i]);
-	}
-	/* ensure that both src and dst are not NULL */
-	if (i > 0) {
-		memmove(term.line, term.line + i, row * sizeof(Line));
-		memmove(term.alt, term.alt + i, row * sizeof(Line));
-		memmove(term.dirty, term.dirty + i, row * sizeof(*term.dirty));
-	}
-	for (i += row; i < term.row; i++) {
-		free(term.line[i]);
-		free(term.alt[i]);
-    free(term.dirty[i]);
-	}
+	off = MAX(term.c.y - row + 1, 0);
 
 	/* resize to new width */
 	// term.specbuf = xrealloc(term.specbuf, col * sizeof(GlyphFontSpec));
 
-	/* resize to new height */
-	term.line = xrealloc(term.line, row * sizeof(Line));
-	term.alt  = xrealloc(term.alt,  row * sizeof(Line));
-	term.dirty = xrealloc(term.dirty, row * sizeof(*term.dirty));
-  term.per_row_dirty = xrealloc(term.per_row_dirty, row * sizeof(*term.per_row_dirty));
+	/*
+	 * rebuild the shared blank rows still in use at the new width, with
+	 * a default one for the rows that carry nothing over
+	 */
+	tblankcompact();
+	style = styleintern(&attr);
+	if (tblankidx(style) < 0 && blanks.len < BLANK_MAX)
+		blanks.style[blanks.len++] = style;
+	oldblanks = blanks.rows;
+	blanks.rows = xmalloc(BLANK_MAX * col * sizeof(Cell));
+	for (i = 0; i < blanks.len * col; i++)
+		blanks.rows[i] = (Cell){ .u = ' ', .style = blanks.style[i / col] };
+
+	i = tblankidx(style);
+	fill = (i < 0) ? NULL : blanks.rows + i * col;
+
+	/* the rows are given slots again as they are written to */
+	tslotflush();
+	term.line = tallocscreen(term.line, col, row, off, mincol, minrow, fill);
+	term.blink = tresizeblink(term.blink, term.line, row, off,
+			mincol, minrow, &term.nblink);
+	if (term.alt) {
+		term.alt = tallocscreen(term.alt, col, row, off, mincol, minrow,
+				fill);
+		term.altblink = tresizeblink(term.altblink, term.alt, row, off,
+				mincol, minrow, &term.altnblink);
+	}
+	free(oldblanks);
+
+	/* everything is marked dirty again below, no need to keep the bits */
+	tallocdirt(col, row);
 	term.tabs = xrealloc(term.tabs, col * sizeof(*term.tabs));
 
-	/* resize each row to new width, zero-pad if needed */
-	for (i = 0; i < minrow; i++) {
-		term.line[i] = xrealloc(term.line[i], col * sizeof(Glyph));
-		term.alt[i]  = xrealloc(term.alt[i],  col * sizeof(Glyph));
-    term.dirty[i] = xrealloc(term.dirty[i], col * sizeof(int));
-	}
-
-	/* allocate any new rows */
-	for (/* i = minrow */; i < row; i++) {
-		term.line[i] = xmalloc(col * sizeof(Glyph));
-		term.alt[i] = xmalloc(col * sizeof(Glyph));
-    term.dirty[i] = xmalloc(col * sizeof(int));
-    term.per_row_dirty[i] = 0;
-	}
 	if (col > term.col) {
 		bp = term.tabs + term.col;
 
@@ -2588,10 +3224,10 @@ tresize(int col, int row)
 	/* Clearing both screens (it makes dirty all lines) */
 	c = term.c;
 	for (i = 0; i < 2; i++) {
-		if (mincol < col && 0 < minrow) {
+		if (term.line && mincol < col && 0 < minrow) {
 			tclearregion(mincol, 0, col - 1, minrow - 1);
 		}
-		if (0 < col && minrow < row) {
+		if (term.line && 0 < col && minrow < row) {
 			tclearregion(0, minrow, col - 1, row - 1);
 		}
 		tswapscreen();
@@ -10,8 +10,9 @@
 #define BETWEEN(x, a, b)	((a) <= (x) && (x) <= (b))
 #define DIVCEIL(n, d)		(((n) + ((d) - 1)) / (d))
 #define LIMIT(x, a, b)		(x) = (x) < (a) ? (a) : (x) > (b) ? (b) : (x)
-#define ATTRCMP(a, b)		((a).mode != (b).mode || (a).fg != (b).fg || \
-				(a).bg != (b).bg)
+#define ATTRCMP(a, b)		((a).style != (b).style || (a).mode != (b).mode)
+#define CELLMODE(c)		(term.styles[(c).style].mode | (c).mode)
+#define ISDIRTY(y, x)		((term.dirty[y].bits[(x) / 64] >> ((x) % 64)) & 1)
 #define IS_SET(flag)		((term.mode & (flag)) != 0)
 #define TIMEDIFF(t1, t2)	((t1.tv_sec-t2.tv_sec)*1000 + \
 				(t1.tv_nsec-t2.tv_nsec)/1E6)
@@ -34,6 +35,7 @@ enum glyph_attribute {
 	ATTR_WIDE       = 1 << 9,
 	ATTR_WDUMMY     = 1 << 10,
 	ATTR_BOLD_FAINT = ATTR_BOLD | ATTR_FAINT,
+	ATTR_LAYOUT     = ATTR_WRAP | ATTR_WIDE | ATTR_WDUMMY,
 };
 
 enum term_mode {
@@ -92,6 +94,7 @@ typedef unsigned short ushort;
 
 typedef uint_least32_t Rune;
 
+/* Expanded cell, used for the cursor attributes and for drawing */
 typedef struct {
 	Rune u;           /* character code */
 	ushort mode;      /* attribute flags */
@@ -99,7 +102,27 @@ typedef struct {
 	uint32_t bg;      /* background  */
 } Glyph;
 
-typedef Glyph *Line;
+/* Colors and rendition flags shared by all cells that use them */
+typedef struct {
+	uint32_t fg;      /* foreground  */
+	uint32_t bg;      /* background  */
+	ushort mode;      /* attribute flags, never ATTR_LAYOUT */
+} Style;
+
+/* Screen cell as stored in the terminal, 8 bytes */
+typedef struct {
+	Rune u;           /* character code */
+	ushort style;     /* index into term.styles */
+	ushort mode;      /* ATTR_LAYOUT flags of this cell */
+} Cell;
+
+typedef Cell *Line;
+
+/* Dirty columns of a row, one bit per column */
+typedef struct {
+	uint64_t *bits;
+	int min, max; /* span of dirty columns, empty if min > max */
+} DirtyRow;
 
 typedef struct {
 	Glyph attr; /* current char attributes */
@@ -114,9 +137,13 @@ typedef struct {
 	int col;      /* nb col */
 	Line *line;   /* screen */
 	Line *alt;    /* alternate screen */
-  int **dirty; /* dirtyness of chars */
-  int *per_row_dirty; /* Number of characters dirty in the given row */
-  int dirty_this_frame; /* Number of things marked dirty this frame */
+	Style *styles; /* interned cell styles, see styleintern() */
+	int *blink;   /* blinking cells per row */
+	int *altblink; /* blinking cells per row of the alternate screen */
+	int nblink;   /* blinking cells on screen */
+	int altnblink; /* blinking cells on the alternate screen */
+	DirtyRow *dirty; /* dirtyness of chars */
+	uint64_t *dirtyrows; /* bitmap of the rows with any dirty column */
 	TCursor c;    /* cursor */
 	int top;      /* top    scroll limit */
 	int bot;      /* bottom scroll limit */
@@ -196,9 +223,14 @@ int tattrset(int);
 void tnew(int, int);
 void tsetdirt(int, int, int, int);
 void tsetdirtattr(int);
+int tdirtycount(int);
+void tcleandirt(int);
+ushort styleintern(const Glyph *);
+Glyph cellglyph(Cell);
 int match(uint, uint);
 void ttynew(void);
 size_t ttyread(void);
+int ttyexited(void);
 void ttyresize(void);
 void ttysend(char *, size_t);
 void ttywrite(const char *, size_t);
@@ -212,6 +244,7 @@ void selclear(void);
 void selinit(void);
 void selnormalize(void);
 int selected(int, int);
+int selspan(int, int *, int *);
 char *getsel(void);
 int x2col(int);
 int y2row(int);
@@ -220,6 +253,7 @@ size_t utf8decode(char *, Rune *, size_t);
 size_t utf8encode(Rune, char *);
 
 void *xmalloc(size_t);
+void *xrealloc(void *, size_t);
 char *xstrdup(char *);
 
 void usage(void);
@@ -249,6 +283,9 @@ extern char font[];
 extern int borderpx;
 extern float cwscale;
 extern float chscale;
+extern Rune fallbackwarm[];
+extern size_t fallbackwarmlen;
+extern unsigned int fallbackmem;
 extern unsigned int doubleclicktimeout;
 extern unsigned int tripleclicktimeout;
 extern int allowaltscreen;
@@ -256,6 +293,7 @@ extern unsigned int xfps;
 extern unsigned int actionfps;
 extern unsigned int cursorthickness;
 extern unsigned int blinktimeout;
+extern unsigned int resizetimeout;
 extern char termname[];
 extern const char *colorname[];
 extern size_t colornamelen;
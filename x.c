@@ -1,12 +1,16 @@
 /* See LICENSE for license details. */
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <locale.h>
 #include <signal.h>
 #include <stdint.h>
 #include <sys/select.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <X11/Xatom.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
@@ -79,12 +83,37 @@ typedef struct {
 	int badweight;
 	short lbearing;
 	short rbearing;
-	FcFontSet *set;
 	FcPattern *pattern;
   FT_Face face;
   struct atlas * atlas;
 } Font;
 
+/* Fallback search for the worker thread, see fbwmain() */
+typedef struct {
+	Rune u;
+	int flags;
+	uint gen;           /* fbw.gen when queued, older results are dropped */
+	FcPattern *pattern; /* font of the style, owned by the job */
+	int state;
+	char *file;         /* result, NULL if fontconfig found nothing */
+	int index;
+} FallbackJob;
+
+enum {
+	FBJ_QUEUED,
+	FBJ_SEARCHING,
+	FBJ_DONE,
+	FBJ_FAILED, /* kept so the rune is not searched for again */
+};
+
+/* Font file fontconfig found for a range of runes, see fbcload() */
+typedef struct {
+	int flags;    /* FRC_* style the runes were looked up in */
+	Rune lo, hi;  /* runes found in the face */
+	int index;    /* face index in file */
+	char *file;
+} Fallback;
+
 /* Drawing Context */
 typedef struct {
 	Color *col;
@@ -95,13 +124,38 @@ typedef struct {
   FcConfig * cfg;
   struct render_context * rc;
   struct glyph_spec * specbuf;
+  uint64_t *rowhash[2]; /* hash of each row as last rendered, per screen */
+  int gridcols, gridrows; /* size of the grid the hashes are for */
+  uint64_t rowgen; /* bumped when rows must be rendered again regardless */
 } DC;
 
 static inline ushort sixd_to_16bit(int);
-static int xmakeglyphfontspecs(struct glyph_spec *, const Glyph *, int, int, int);
+static int xmakeglyphfontspecs(struct glyph_spec *, const Cell *, int, int, int);
+static Font *xmodefont(ushort, int *);
+static FT_UInt xglyphlookup(Rune, Font *, int, struct atlas **);
+static FT_UInt xfindglyph(Rune, Font *, int, struct atlas **, int *);
+static void xglyphcacheclear(void);
+static int frcadd(struct atlas *, int, Rune);
+static void frctrim(void);
+static void frcstats(void);
+static void xfallbackdone(void);
+static void xfallbackwarm(void);
+static char *fbfind(Rune, FcPattern *, FcFontSet *, int *);
+static void fbwinit(void);
+static void *fbwmain(void *);
+static void fbwqueue(Rune, int, Font *);
+static void fbwfailed(Rune, int, uint);
+static uint64_t fbchash(uint64_t, const void *, size_t);
+static uint64_t fbchashfiles(uint64_t, FcStrList *);
+static void fbcload(const char *);
+static Fallback *fbclookup(Rune, int);
+static void fbcadd(Rune, int, const char *, int);
+static void fbcsave(void);
 static void xdrawglyphfontspecs(struct glyph_spec *, Glyph, int, int, int);
 static void xdrawglyph(Glyph, int, int);
 static void xclear(int, int, int, int);
+static void xloadpalette(void);
+static uint64_t xrowhash(int, int, int, int);
 static void xdrawcursor(void);
 static int xgeommasktogravity(int);
 static int xloadfont(Font *, FcPattern *);
@@ -110,8 +164,6 @@ static void xunloadfont(Font *);
 static void convert_color(XRenderColor * in, struct color * out);
 
 static void gl_draw_rect(Color *, int x, int y, int w, int h);
-static void gl_draw_glyph(Color *, struct glyph_spec *);
-static void gl_draw_glyphs(Color *, struct glyph_spec *, int);
 
 static void expose(XEvent *);
 static void visibility(XEvent *);
@@ -119,6 +171,8 @@ static void unmap(XEvent *);
 static void kpress(XEvent *);
 static void cmessage(XEvent *);
 static void resize(XEvent *);
+static void xresizesettle(struct timespec);
+static void xexit(void);
 static void focus(XEvent *);
 static void brelease(XEvent *);
 static void bpress(XEvent *);
@@ -175,11 +229,94 @@ typedef struct {
 	struct atlas * atlas;
 	int flags;
 	Rune unicodep;
+	ulong lastuse; /* frc.frame a glyph of the font was last looked up in */
 } Fontcache;
 
-/* Fontcache is an array now. A new font will be appended to the array. */
-static Fontcache frc[16];
-static int frclen = 0;
+/*
+ * Fallback fonts. Once their atlases take more than fallbackmem, the
+ * least recently used ones are destroyed at the start of a frame, see
+ * frctrim(). Fonts used since the rows were last all drawn may be on
+ * screen and are kept, even over budget.
+ */
+static struct {
+	Fontcache *ent;
+	int len, cap;
+	ulong frame;    /* frames drawn so far */
+	ulong redrawn;  /* frame all rows were last drawn in */
+	uint64_t rowgen; /* dc.rowgen as of redrawn */
+	ulong hits, misses, evictions;
+} frc;
+
+/*
+ * Glyph cache, the font and glyph xfindglyph() resolved a rune to in each
+ * style. Direct-mapped: dense for runes below GLYPHCACHE_DENSE, hashed
+ * beyond that, so resolving a cell is a load or two.
+ */
+typedef struct {
+	Rune u;
+	int flags;
+	int valid;
+	int frc;             /* index in frc.ent, -1 for none */
+	struct atlas *atlas; /* NULL for a placeholder */
+	FT_UInt glyph;
+} Glyphcache;
+
+#define GLYPHCACHE_DENSE	256
+#define GLYPHCACHE_BITS		12
+
+static Glyphcache gcdense[FRC_ITALICBOLD + 1][GLYPHCACHE_DENSE];
+static Glyphcache gchashed[1 << GLYPHCACHE_BITS];
+
+/*
+ * Fallback cache, the font file fontconfig found for runes missing from
+ * the configured fonts. Kept across sessions in a file under
+ * $XDG_CACHE_HOME/stgl named after a hash of the fontconfig version, its
+ * configuration files and font directories with their modification times
+ * and the configured font, see fbcload().
+ */
+static struct {
+	Fallback *ent;
+	int len, cap;
+	char *path;   /* cache file, NULL if it is not kept */
+	int dirty;    /* entries were added since it was written */
+	struct timespec dirtied; /* when dirty was set */
+} fbc;
+
+/* Time from the first entry added to the cache file being written, ms */
+#define FBCSAVEDELAY	2000
+
+/*
+ * Fallback worker. The fontconfig search for runes no loaded font has
+ * runs on a thread of its own, cells show a placeholder box meanwhile.
+ * The worker wakes the main loop through pipe, which then opens the face,
+ * see xfallbackdone(). jobs is shared and guarded by lock.
+ */
+static struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int pipe[2];
+	FallbackJob *jobs;
+	int len, cap;
+	uint gen;     /* bumped when the fonts are loaded again */
+} fbw = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.pipe = { -1, -1 },
+};
+
+/*
+ * Window size from the last ConfigureNotify. A drag sends dozens of them,
+ * the terminal and the renderer take the latest at most once per frame
+ * and the tty only once the grid has not changed for resizetimeout
+ * milliseconds, see xresizesettle().
+ */
+static struct {
+	int w, h;
+	int pending;   /* not applied yet */
+	int tty;       /* the grid changed since the tty was told */
+	struct timespec last; /* when the grid last changed */
+} rsz;
 
 void
 getbuttoninfo(XEvent *e)
@@ -639,13 +776,26 @@ xloadcols(void)
 			else
 				die("Could not allocate color %d\n", i);
 		}
-    if (dc.rc && i == defaultbg) {
-      struct color c;
-      convert_color(&(dc.col + i)->color, &c);
-      render_set_clear_color(dc.rc, &c);
-    }
-  }
+	}
 	loaded = 1;
+	if (dc.rc)
+		xloadpalette();
+}
+
+/*
+ * Hands the colours to the renderer, which resolves every cell against
+ * them. Changing a colour thus never requires redrawing rows.
+ */
+void
+xloadpalette(void)
+{
+	struct color pal[RENDER_PALETTE_SIZE];
+	int i, n = MIN(dc.collen, RENDER_PALETTE_SIZE);
+
+	for (i = 0; i < n; i++)
+		convert_color(&dc.col[i].color, &pal[i]);
+	render_set_palette(dc.rc, pal, n, defaultfg, defaultbg);
+	render_set_clear_color(dc.rc, &pal[defaultbg]);
 }
 
 int
@@ -662,6 +812,7 @@ xsetcolorname(int x, const char *name)
 
 	XftColorFree(xw.dpy, xw.vis, xw.cmap, &dc.col[x]);
 	dc.col[x] = ncolor;
+	xloadpalette();
 
 	return 0;
 }
@@ -811,7 +962,6 @@ xloadfont(Font *f, FcPattern *pattern)
   FcObjectSetDestroy(obj);
   FcFontSetDestroy(fs);
 
-	f->set = NULL;
 	f->pattern = configured;
 
   // All freetype values are in "font units". To convert this to actual units
@@ -893,6 +1043,14 @@ xloadfonts(char *fontstr, double fontsize)
 		die("st: can't open font %s\n", fontstr);
 
 	FcPatternDestroy(pattern);
+	fbcload(fontstr);
+	dc.rowgen++;
+
+	/* searches queued for the old fonts are of no use anymore */
+	pthread_mutex_lock(&fbw.lock);
+	fbw.gen++;
+	pthread_mutex_unlock(&fbw.lock);
+	xfallbackwarm();
 }
 
 void
@@ -900,17 +1058,17 @@ xunloadfont(Font *f)
 {
   FT_Done_Face(f->face);
 	FcPatternDestroy(f->pattern);
-	if (f->set)
-		FcFontSetDestroy(f->set);
 }
 
 void
 xunloadfonts(void)
 {
 	/* Free the loaded fonts in the font cache.  */
-	while (frclen > 0) {
-    atlas_destroy(frc[--frclen].atlas, true);
-  }
+	while (frc.len > 0) {
+		render_forget_atlas(dc.rc, frc.ent[--frc.len].atlas);
+		atlas_destroy(frc.ent[frc.len].atlas, true);
+	}
+	xglyphcacheclear();
 
 	xunloadfont(&dc.font);
 	xunloadfont(&dc.bfont);
@@ -1051,7 +1209,7 @@ xinit(void)
 }
 
 int
-xmakeglyphfontspecs(struct glyph_spec *specs, const Glyph *glyphs, int len, int x, int y)
+xmakeglyphfontspecs(struct glyph_spec *specs, const Cell *cells, int len, int x, int y)
 {
 	float winx = borderpx + x * win.cw, winy = borderpx + y * win.ch, xp, yp;
 	ushort mode, prevmode = USHRT_MAX;
@@ -1059,259 +1217,702 @@ xmakeglyphfontspecs(struct glyph_spec *specs, const Glyph *glyphs, int len, int
 	int frcflags = FRC_NORMAL;
 	float runewidth = win.cw;
 	Rune rune;
-	FT_UInt glyphidx;
-	FcResult fcres;
-	FcPattern *fcpattern, *fontpattern;
-	FcFontSet *fcsets[] = { NULL };
-	FcCharSet *fccharset;
-	int i, f, numspecs = 0;
+	int i, numspecs = 0;
 
-  int minor_dirty = 1;
-  // int minor_dirty = term.dirty_this_frame < (4 * term.row * term.col / 5);
-  minor_dirty = minor_dirty && term.per_row_dirty[y] < (term.row - 1);
+  int minor_dirty = tdirtycount(y) < (term.row - 1);
 
 	for (i = 0, xp = winx, yp = winy + font->ascent; i < len; ++i) {
 		/* Fetch rune and mode for current glyph. */
-		rune = glyphs[i].u;
-		mode = glyphs[i].mode;
-    if (term.dirty[y][x + i]) {
-      term.dirty[y][x + i] = 0;
-      if (minor_dirty) {
-        specs[numspecs].dirty = 1;
-      } else {
-        specs[numspecs].dirty = 0;
-      }
-    } else {
-      specs[numspecs].dirty = 0;
-    }
+		rune = cells[i].u;
+		mode = CELLMODE(cells[i]);
+    specs[numspecs].dirty = minor_dirty && ISDIRTY(y, x + i);
 
 		/* Skip dummy wide-character spacing. */
-		if (mode == ATTR_WDUMMY)
+		if (cells[i].mode == ATTR_WDUMMY)
 			continue;
 
 		/* Determine font for glyph if different from previous glyph. */
 		if (prevmode != mode) {
 			prevmode = mode;
-			font = &dc.font;
-			frcflags = FRC_NORMAL;
+			font = xmodefont(mode, &frcflags);
 			runewidth = win.cw * ((mode & ATTR_WIDE) ? 2.0f : 1.0f);
-			if ((mode & ATTR_ITALIC) && (mode & ATTR_BOLD)) {
-				font = &dc.ibfont;
-				frcflags = FRC_ITALICBOLD;
-			} else if (mode & ATTR_ITALIC) {
-				font = &dc.ifont;
-				frcflags = FRC_ITALIC;
-			} else if (mode & ATTR_BOLD) {
-				font = &dc.bfont;
-				frcflags = FRC_BOLD;
-			}
 			yp = winy + font->ascent;
 		}
 
-		/* Lookup character index with default font. */
-		glyphidx = FT_Get_Char_Index(font->face, rune);
-		if (glyphidx) {
-			specs[numspecs].font = font->atlas;
-			specs[numspecs].glyph = glyphidx;
-			specs[numspecs].x = xp;
-			specs[numspecs].y = yp;
-			xp += runewidth;
-			numspecs++;
-			continue;
-		}
+		specs[numspecs].glyph = xglyphlookup(rune, font, frcflags,
+				&specs[numspecs].font);
+		specs[numspecs].x = (short)xp;
+		specs[numspecs].y = (short)yp;
+		xp += runewidth;
+		numspecs++;
+	}
 
-		/* Fallback on font cache, search the font cache for match. */
-		for (f = 0; f < frclen; f++) {
-      glyphidx = FT_Get_Char_Index(atlas_get_face(frc[f].atlas), rune);
-			/* Everything correct. */
-			if (glyphidx && frc[f].flags == frcflags)
-				break;
-			/* We got a default font for a not found glyph. */
-			if (!glyphidx && frc[f].flags == frcflags
-					&& frc[f].unicodep == rune) {
-				break;
-			}
-		}
+	return numspecs;
+}
 
-		/* Nothing was found. Use fontconfig to find matching font. */
-		if (f >= frclen) {
-			if (!font->set)
-				font->set = FcFontSort(0, font->pattern,
-				                       1, 0, &fcres);
-			fcsets[0] = font->set;
+/* Returns the font of glyphs drawn in mode and its FRC_* style */
+Font *
+xmodefont(ushort mode, int *frcflags)
+{
+	if ((mode & ATTR_ITALIC) && (mode & ATTR_BOLD)) {
+		*frcflags = FRC_ITALICBOLD;
+		return &dc.ibfont;
+	} else if (mode & ATTR_ITALIC) {
+		*frcflags = FRC_ITALIC;
+		return &dc.ifont;
+	} else if (mode & ATTR_BOLD) {
+		*frcflags = FRC_BOLD;
+		return &dc.bfont;
+	}
+	*frcflags = FRC_NORMAL;
+	return &dc.font;
+}
 
-			/*
-			 * Nothing was found in the cache. Now use
-			 * some dozen of Fontconfig calls to get the
-			 * font for one single character.
-			 *
-			 * Xft and fontconfig are design failures.
-			 */
-			fcpattern = FcPatternDuplicate(font->pattern);
-			fccharset = FcCharSetCreate();
+/*
+ * Resolves the glyph of rune in the style frcflags, font being the font of
+ * that style, through the glyph cache.
+ */
+FT_UInt
+xglyphlookup(Rune rune, Font *font, int frcflags, struct atlas **atlas)
+{
+	Glyphcache *gc;
+
+	if (rune < GLYPHCACHE_DENSE)
+		gc = &gcdense[frcflags][rune];
+	else
+		gc = &gchashed[((rune << 2 | frcflags) * 2654435761u)
+		               >> (32 - GLYPHCACHE_BITS)];
+
+	if (!gc->valid || gc->u != rune || gc->flags != frcflags) {
+		gc->glyph = xfindglyph(rune, font, frcflags, &gc->atlas,
+		                       &gc->frc);
+		gc->u = rune;
+		gc->flags = frcflags;
+		gc->valid = 1;
+	}
+	if (gc->frc >= 0)
+		frc.ent[gc->frc].lastuse = frc.frame;
+	*atlas = gc->atlas;
+	return gc->glyph;
+}
 
-			FcCharSetAddChar(fccharset, rune);
-			FcPatternAddCharSet(fcpattern, FC_CHARSET,
-					fccharset);
-			FcPatternAddBool(fcpattern, FC_SCALABLE, 1);
+/*
+ * Finds the font and glyph for rune, falling back on the font cache, the
+ * fallback cache and finally on fontconfig if font does not have it.
+ */
+FT_UInt
+xfindglyph(Rune rune, Font *font, int frcflags, struct atlas **atlas,
+           int *frcidx)
+{
+	FT_UInt glyphidx;
+	Fallback *fb;
+	struct atlas *a;
+	int f;
+
+	/* Lookup character index with default font. */
+	*frcidx = -1;
+	glyphidx = FT_Get_Char_Index(font->face, rune);
+	if (glyphidx) {
+		*atlas = font->atlas;
+		return glyphidx;
+	}
 
-			FcConfigSubstitute(0, fcpattern,
-					FcMatchPattern);
-			FcDefaultSubstitute(fcpattern);
+	/* Fallback on font cache, search the font cache for match. */
+	for (f = 0; f < frc.len; f++) {
+		if (frc.ent[f].flags != frcflags)
+			continue;
+		glyphidx = FT_Get_Char_Index(atlas_get_face(frc.ent[f].atlas), rune);
+		/* Everything correct. */
+		if (glyphidx)
+			break;
+		/* We got a default font for a not found glyph. */
+		if (frc.ent[f].unicodep == rune)
+			break;
+	}
 
-			fontpattern = FcFontSetMatch(0, fcsets, 1,
-					fcpattern, &fcres);
+	if (f < frc.len) {
+		frc.hits++;
+	} else {
+		/*
+		 * Nothing was found. Use the font an earlier session found, or
+		 * have the worker find one and draw a placeholder until then.
+		 */
+		frc.misses++;
+		fb = fbclookup(rune, frcflags);
+		a = fb ? atlas_create_from_file(dc.lib, fb->file, fb->index,
+		                                font_size) : NULL;
+		if (!a) {
+			fbwqueue(rune, frcflags, font);
+			*atlas = NULL;
+			return 0;
+		}
+		f = frcadd(a, frcflags, rune);
+		glyphidx = FT_Get_Char_Index(atlas_get_face(a), rune);
+	}
 
-			/*
-			 * Overwrite or create the new cache entry.
-			 */
-			if (frclen >= LEN(frc)) {
-				frclen = LEN(frc) - 1;
-        atlas_destroy(frc[frclen].atlas, true);
-				frc[frclen].unicodep = 0;
-			}
+	*frcidx = f;
+	*atlas = frc.ent[f].atlas;
+	return glyphidx;
+}
 
-      frc[frclen].atlas = atlas_create_from_pattern(dc.lib, fontpattern, font_size);
-			if (!frc[frclen].atlas)
-				die("atlas_create_from_pattern failed seeking fallback font: %s\n",
-					strerror(errno));
-			frc[frclen].flags = frcflags;
-			frc[frclen].unicodep = rune;
+/* Adds a fallback font to the font cache, returns its index */
+int
+frcadd(struct atlas *a, int frcflags, Rune rune)
+{
+	if (frc.len == frc.cap) {
+		frc.cap = frc.cap ? frc.cap * 2 : 16;
+		frc.ent = xrealloc(frc.ent, frc.cap * sizeof(*frc.ent));
+	}
+	frc.ent[frc.len] = (Fontcache){
+		.atlas = a,
+		.flags = frcflags,
+		.unicodep = rune,
+		.lastuse = frc.frame,
+	};
+
+	return frc.len++;
+}
 
-			glyphidx = FT_Get_Char_Index(atlas_get_face(frc[frclen].atlas), rune);
+/*
+ * Starts a frame, destroying least recently used fallback fonts while
+ * the cache is over budget. Evicting moves entries, so it never happens
+ * while a frame is drawn and glyph specs hold atlases.
+ */
+void
+frctrim(void)
+{
+	size_t mem = 0, budget = (size_t)fallbackmem << 20;
+	int i, lru, evicted = 0;
 
-			f = frclen;
-			frclen++;
+	frc.frame++;
+	for (i = 0; i < frc.len; i++)
+		mem += atlas_memory(frc.ent[i].atlas);
 
-			FcPatternDestroy(fcpattern);
-			FcCharSetDestroy(fccharset);
+	while (mem > budget) {
+		lru = -1;
+		for (i = 0; i < frc.len; i++) {
+			if (frc.ent[i].lastuse >= frc.redrawn)
+				continue;
+			if (lru < 0 || frc.ent[i].lastuse < frc.ent[lru].lastuse)
+				lru = i;
 		}
+		if (lru < 0)
+			break;
 
-		specs[numspecs].font = frc[f].atlas;
-		specs[numspecs].glyph = glyphidx;
-		specs[numspecs].x = (short)xp;
-		specs[numspecs].y = (short)yp;
-		xp += runewidth;
-		numspecs++;
+		mem -= atlas_memory(frc.ent[lru].atlas);
+		render_forget_atlas(dc.rc, frc.ent[lru].atlas);
+		atlas_destroy(frc.ent[lru].atlas, true);
+		frc.ent[lru] = frc.ent[--frc.len];
+		frc.evictions++;
+		evicted = 1;
 	}
 
-	return numspecs;
+	/* glyph cache indices are stale, rows lost their glyphs */
+	if (evicted) {
+		xglyphcacheclear();
+		dc.rowgen++;
+	}
+	if (frc.rowgen != dc.rowgen) {
+		frc.rowgen = dc.rowgen;
+		frc.redrawn = frc.frame;
+	}
 }
 
+/* Prints the fallback cache counters, at exit if STGL_FRCSTATS is set */
 void
-xdrawglyphfontspecs(struct glyph_spec *specs, Glyph base, int len, int x, int y)
+frcstats(void)
 {
-	int charlen = len * ((base.mode & ATTR_WIDE) ? 2 : 1);
-	int winx = borderpx + x * win.cw, winy = borderpx + y * win.ch,
-	    width = charlen * win.cw;
-	Color *fg, *bg, *temp, revfg, revbg, truefg, truebg;
-	XRenderColor colfg, colbg;
-	XRectangle r;
+	size_t mem = 0;
+	int i;
+
+	for (i = 0; i < frc.len; i++)
+		mem += atlas_memory(frc.ent[i].atlas);
+	printf("Fallback fonts: %d using %zu KiB, %lu hits, %lu misses, "
+	       "%lu evictions\n", frc.len, mem >> 10, frc.hits, frc.misses,
+	       frc.evictions);
+}
 
-	/* Fallback on color display for attributes not supported by the font */
-	if (base.mode & ATTR_ITALIC && base.mode & ATTR_BOLD) {
-		if (dc.ibfont.badslant || dc.ibfont.badweight)
-			base.fg = defaultattr;
-	} else if ((base.mode & ATTR_ITALIC && dc.ifont.badslant) ||
-	    (base.mode & ATTR_BOLD && dc.bfont.badweight)) {
-		base.fg = defaultattr;
+void
+xglyphcacheclear(void)
+{
+	memset(gcdense, 0, sizeof(gcdense));
+	memset(gchashed, 0, sizeof(gchashed));
+}
+
+/*
+ * Opens the faces the worker found. The rows are drawn again, as their
+ * placeholders become glyphs. Finished jobs are only taken out of
+ * fbw.jobs under the lock, the faces are opened once it is released so
+ * the worker can go on meanwhile.
+ */
+void
+xfallbackdone(void)
+{
+	static FallbackJob *done;
+	static int cap;
+	char buf[64];
+	FallbackJob *j;
+	struct atlas *a;
+	uint gen;
+	int i, n = 0, found = 0;
+
+	while (read(fbw.pipe[0], buf, sizeof(buf)) > 0)
+		;
+
+	pthread_mutex_lock(&fbw.lock);
+	gen = fbw.gen;
+	for (i = 0; i < fbw.len; i++) {
+		j = &fbw.jobs[i];
+		/* failures for older fonts would only pile up */
+		if (j->state == FBJ_FAILED && j->gen != gen) {
+			fbw.jobs[i--] = fbw.jobs[--fbw.len];
+			continue;
+		}
+		if (j->state != FBJ_DONE)
+			continue;
+		if (j->gen == gen && !j->file) {
+			FcPatternDestroy(j->pattern);
+			j->pattern = NULL;
+			j->state = FBJ_FAILED;
+			continue;
+		}
+		if (n == cap) {
+			cap = cap ? cap * 2 : 16;
+			done = xrealloc(done, cap * sizeof(*done));
+		}
+		done[n++] = *j;
+		fbw.jobs[i--] = fbw.jobs[--fbw.len];
+	}
+	pthread_mutex_unlock(&fbw.lock);
+
+	for (i = 0; i < n; i++) {
+		j = &done[i];
+		a = NULL;
+		if (j->gen == gen && j->file)
+			a = atlas_create_from_file(dc.lib, j->file, j->index,
+			                           font_size);
+		if (a) {
+			frcadd(a, j->flags, j->u);
+			fbcadd(j->u, j->flags, j->file, j->index);
+			found = 1;
+		} else if (j->gen == gen) {
+			/* the face would not open, do not search for it again */
+			fbwfailed(j->u, j->flags, gen);
+		}
+		FcPatternDestroy(j->pattern);
+		free(j->file);
 	}
 
-	if (IS_TRUECOL(base.fg)) {
-		colfg.alpha = 0xffff;
-		colfg.red = TRUERED(base.fg);
-		colfg.green = TRUEGREEN(base.fg);
-		colfg.blue = TRUEBLUE(base.fg);
-		XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colfg, &truefg);
-		fg = &truefg;
-	} else {
-		fg = &dc.col[base.fg];
+	if (found) {
+		xglyphcacheclear();
+		dc.rowgen++;
 	}
+}
 
-	if (IS_TRUECOL(base.bg)) {
-		colbg.alpha = 0xffff;
-		colbg.green = TRUEGREEN(base.bg);
-		colbg.red = TRUERED(base.bg);
-		colbg.blue = TRUEBLUE(base.bg);
-		XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colbg, &truebg);
-		bg = &truebg;
-	} else {
-		bg = &dc.col[base.bg];
+/* Looks the fallbacks of the scripts in fallbackwarm up ahead of time */
+void
+xfallbackwarm(void)
+{
+	struct atlas *a;
+	size_t i;
+
+	for (i = 0; i < fallbackwarmlen; i++)
+		xglyphlookup(fallbackwarm[i], &dc.font, FRC_NORMAL, &a);
+}
+
+/*
+ * Uses fontconfig to find the font file with rune among set, the fonts
+ * sorted for pattern. Runs on the worker thread.
+ */
+char *
+fbfind(Rune rune, FcPattern *pattern, FcFontSet *set, int *index)
+{
+	FcResult fcres;
+	FcPattern *fcpattern, *fontpattern;
+	FcFontSet *fcsets[] = { set };
+	FcCharSet *fccharset;
+	FcChar8 *file;
+	char *ret = NULL;
+
+	if (!set)
+		return NULL;
+
+	/*
+	 * Nothing was found in the cache. Now use
+	 * some dozen of Fontconfig calls to get the
+	 * font for one single character.
+	 *
+	 * Xft and fontconfig are design failures.
+	 */
+	fcpattern = FcPatternDuplicate(pattern);
+	fccharset = FcCharSetCreate();
+
+	FcCharSetAddChar(fccharset, rune);
+	FcPatternAddCharSet(fcpattern, FC_CHARSET,
+			fccharset);
+	FcPatternAddBool(fcpattern, FC_SCALABLE, 1);
+
+	FcConfigSubstitute(0, fcpattern,
+			FcMatchPattern);
+	FcDefaultSubstitute(fcpattern);
+
+	fontpattern = FcFontSetMatch(0, fcsets, 1,
+			fcpattern, &fcres);
+	if (fontpattern) {
+		if (FcPatternGetString(fontpattern, FC_FILE, 0, &file) == FcResultMatch &&
+		    FcPatternGetInteger(fontpattern, FC_INDEX, 0, index) == FcResultMatch)
+			ret = xstrdup((char *)file);
+		FcPatternDestroy(fontpattern);
 	}
 
-	/* Change basic system colors [0-7] to bright system colors [8-15] */
-	if ((base.mode & ATTR_BOLD_FAINT) == ATTR_BOLD && BETWEEN(base.fg, 0, 7))
-		fg = &dc.col[base.fg + 8];
+	FcPatternDestroy(fcpattern);
+	FcCharSetDestroy(fccharset);
 
-	if (IS_SET(MODE_REVERSE)) {
-		if (fg == &dc.col[defaultfg]) {
-			fg = &dc.col[defaultbg];
-		} else {
-			colfg.red = ~fg->color.red;
-			colfg.green = ~fg->color.green;
-			colfg.blue = ~fg->color.blue;
-			colfg.alpha = fg->color.alpha;
-			XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colfg,
-					&revfg);
-			fg = &revfg;
+	return ret;
+}
+
+void
+fbwinit(void)
+{
+	if (pipe(fbw.pipe) < 0)
+		die("pipe failed: %s\n", strerror(errno));
+	fcntl(fbw.pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(fbw.pipe[1], F_SETFL, O_NONBLOCK);
+	if ((errno = pthread_create(&fbw.thread, NULL, fbwmain, NULL)))
+		die("pthread_create failed: %s\n", strerror(errno));
+}
+
+void *
+fbwmain(void *arg)
+{
+	FcFontSet *sets[FRC_ITALICBOLD + 1] = { NULL };
+	FcResult fcres;
+	FallbackJob job;
+	uint gen = 0;
+	char *file;
+	int i, index = 0;
+
+	pthread_mutex_lock(&fbw.lock);
+	for (;;) {
+		for (i = 0; i < fbw.len && fbw.jobs[i].state != FBJ_QUEUED; i++)
+			;
+		if (i == fbw.len) {
+			pthread_cond_wait(&fbw.cond, &fbw.lock);
+			continue;
+		}
+		fbw.jobs[i].state = FBJ_SEARCHING;
+		job = fbw.jobs[i];
+		pthread_mutex_unlock(&fbw.lock);
+
+		/* the fonts sorted for each style, for this generation */
+		if (job.gen != gen) {
+			for (i = 0; i < LEN(sets); i++) {
+				if (sets[i])
+					FcFontSetDestroy(sets[i]);
+				sets[i] = NULL;
+			}
+			gen = job.gen;
+		}
+		if (!sets[job.flags])
+			sets[job.flags] = FcFontSort(0, job.pattern, 1, 0, &fcres);
+		file = fbfind(job.u, job.pattern, sets[job.flags], &index);
+
+		/* the main thread may have moved the job meanwhile */
+		pthread_mutex_lock(&fbw.lock);
+		for (i = 0; i < fbw.len; i++) {
+			if (fbw.jobs[i].state == FBJ_SEARCHING &&
+			    fbw.jobs[i].u == job.u &&
+			    fbw.jobs[i].flags == job.flags &&
+			    fbw.jobs[i].gen == job.gen)
+				break;
 		}
+		if (i == fbw.len) {
+			free(file);
+			continue;
+		}
+		fbw.jobs[i].file = file;
+		fbw.jobs[i].index = index;
+		fbw.jobs[i].state = FBJ_DONE;
+		if (write(fbw.pipe[1], "", 1) < 0 && errno != EAGAIN)
+			fprintf(stderr, "st: fallback worker: %s\n", strerror(errno));
+	}
 
-		if (bg == &dc.col[defaultbg]) {
-			bg = &dc.col[defaultfg];
-		} else {
-			colbg.red = ~bg->color.red;
-			colbg.green = ~bg->color.green;
-			colbg.blue = ~bg->color.blue;
-			colbg.alpha = bg->color.alpha;
-			XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colbg,
-					&revbg);
-			bg = &revbg;
+	return NULL;
+}
+
+/* Has the worker look for a font with rune, unless it does already */
+void
+fbwqueue(Rune rune, int frcflags, Font *font)
+{
+	FallbackJob *j;
+	int i;
+
+	pthread_mutex_lock(&fbw.lock);
+	for (i = 0; i < fbw.len; i++) {
+		j = &fbw.jobs[i];
+		if (j->u == rune && j->flags == frcflags && j->gen == fbw.gen) {
+			pthread_mutex_unlock(&fbw.lock);
+			return;
 		}
 	}
+	if (fbw.len == fbw.cap) {
+		fbw.cap = fbw.cap ? fbw.cap * 2 : 16;
+		fbw.jobs = xrealloc(fbw.jobs, fbw.cap * sizeof(*fbw.jobs));
+	}
+	fbw.jobs[fbw.len++] = (FallbackJob){
+		.u = rune,
+		.flags = frcflags,
+		.gen = fbw.gen,
+		.pattern = FcPatternDuplicate(font->pattern),
+		.state = FBJ_QUEUED,
+	};
+	pthread_cond_signal(&fbw.cond);
+	pthread_mutex_unlock(&fbw.lock);
+}
 
-	if (base.mode & ATTR_REVERSE) {
-		temp = fg;
-		fg = bg;
-		bg = temp;
+/* Records that no usable font has rune, so it is not queued again */
+void
+fbwfailed(Rune rune, int frcflags, uint gen)
+{
+	pthread_mutex_lock(&fbw.lock);
+	if (fbw.len == fbw.cap) {
+		fbw.cap = fbw.cap ? fbw.cap * 2 : 16;
+		fbw.jobs = xrealloc(fbw.jobs, fbw.cap * sizeof(*fbw.jobs));
 	}
+	fbw.jobs[fbw.len++] = (FallbackJob){
+		.u = rune,
+		.flags = frcflags,
+		.gen = gen,
+		.state = FBJ_FAILED,
+	};
+	pthread_mutex_unlock(&fbw.lock);
+}
+
+uint64_t
+fbchash(uint64_t h, const void *p, size_t n)
+{
+	const uchar *c = p;
+
+	while (n--)
+		h = (h ^ *c++) * 0x100000001b3ULL;
+	return h;
+}
 
-	if ((base.mode & ATTR_BOLD_FAINT) == ATTR_FAINT) {
-		colfg.red = fg->color.red / 2;
-		colfg.green = fg->color.green / 2;
-		colfg.blue = fg->color.blue / 2;
-		XftColorAllocValue(xw.dpy, xw.vis, xw.cmap, &colfg, &revfg);
-		fg = &revfg;
+/* Hashes the names of the files in l along with their modification times */
+uint64_t
+fbchashfiles(uint64_t h, FcStrList *l)
+{
+	FcChar8 *s;
+	struct stat st;
+
+	if (!l)
+		return h;
+	while ((s = FcStrListNext(l))) {
+		h = fbchash(h, s, strlen((char *)s) + 1);
+		if (stat((char *)s, &st) == 0)
+			h = fbchash(h, &st.st_mtime, sizeof(st.st_mtime));
 	}
+	FcStrListDone(l);
+	return h;
+}
 
-	if (base.mode & ATTR_BLINK && term.mode & MODE_BLINK)
-		fg = bg;
+/*
+ * Loads the fallbacks earlier sessions found for fontstr with the current
+ * fontconfig setup. Installing fonts changes the modification time of
+ * their directory, which selects another file.
+ */
+void
+fbcload(const char *fontstr)
+{
+	char path[PATH_MAX], file[PATH_MAX];
+	const char *dir;
+	uint64_t key = 0xcbf29ce484222325ULL;
+	uint lo, hi;
+	int version = FcGetVersion(), flags, index, n;
+	FILE *fp;
+	Fallback *fb;
+
+	/* what the old fonts found still goes to their file */
+	fbcsave();
+	for (n = 0; n < fbc.len; n++)
+		free(fbc.ent[n].file);
+	free(fbc.path);
+	fbc.len = 0;
+	fbc.path = NULL;
+	fbc.dirty = 0;
+
+	key = fbchash(key, &version, sizeof(version));
+	key = fbchashfiles(key, FcConfigGetConfigFiles(NULL));
+	key = fbchashfiles(key, FcConfigGetFontDirs(NULL));
+	key = fbchash(key, fontstr, strlen(fontstr));
+
+	if ((dir = getenv("XDG_CACHE_HOME")) && dir[0] == '/')
+		n = snprintf(path, sizeof(path), "%s/stgl", dir);
+	else if ((dir = getenv("HOME")))
+		n = snprintf(path, sizeof(path), "%s/.cache/stgl", dir);
+	else
+		return;
+	if (n < 0 || n + 32 >= sizeof(path))
+		return;
+	snprintf(path + n, sizeof(path) - n, "/fallback-%016llx",
+			(unsigned long long)key);
+	fbc.path = xstrdup(path);
+
+	if (!(fp = fopen(path, "r")))
+		return;
+	/* one "flags lo hi index file" line per range */
+	while (fscanf(fp, "%d %u %u %d ", &flags, &lo, &hi, &index) == 4 &&
+	       fgets(file, sizeof(file), fp)) {
+		file[strcspn(file, "\n")] = '\0';
+		if (!BETWEEN(flags, FRC_NORMAL, FRC_ITALICBOLD) || lo > hi ||
+		    !file[0])
+			continue;
+		if (fbc.len == fbc.cap) {
+			fbc.cap = fbc.cap ? fbc.cap * 2 : 16;
+			fbc.ent = xrealloc(fbc.ent, fbc.cap * sizeof(*fbc.ent));
+		}
+		fb = &fbc.ent[fbc.len++];
+		fb->flags = flags;
+		fb->lo = lo;
+		fb->hi = hi;
+		fb->index = index;
+		fb->file = xstrdup(file);
+	}
+	fclose(fp);
+}
 
-	if (base.mode & ATTR_INVISIBLE)
-		fg = bg;
+Fallback *
+fbclookup(Rune u, int flags)
+{
+	int i;
 
-	/* Clean up the region we want to draw to. */
-  gl_draw_rect(bg, winx, winy, width, win.ch);
+	for (i = 0; i < fbc.len; i++) {
+		if (fbc.ent[i].flags == flags && BETWEEN(u, fbc.ent[i].lo,
+		    fbc.ent[i].hi))
+			return &fbc.ent[i];
+	}
+	return NULL;
+}
 
-	/* Render the glyphs. */
-  gl_draw_glyphs(fg, specs, len);
+/*
+ * Remembers that fontconfig found u in face index of file. Runes next to
+ * a range already found in the same face extend it.
+ */
+void
+fbcadd(Rune u, int flags, const char *file, int index)
+{
+	Fallback *fb;
+	int i;
+
+	for (i = 0; i < fbc.len; i++) {
+		fb = &fbc.ent[i];
+		if (fb->flags != flags || fb->index != index ||
+		    strcmp(fb->file, file))
+			continue;
+		if (u + 1 == fb->lo) {
+			fb->lo = u;
+			break;
+		}
+		if (u == fb->hi + 1) {
+			fb->hi = u;
+			break;
+		}
+	}
+	if (i == fbc.len) {
+		if (fbc.len == fbc.cap) {
+			fbc.cap = fbc.cap ? fbc.cap * 2 : 16;
+			fbc.ent = xrealloc(fbc.ent, fbc.cap * sizeof(*fbc.ent));
+		}
+		fb = &fbc.ent[fbc.len++];
+		fb->flags = flags;
+		fb->lo = fb->hi = u;
+		fb->index = index;
+		fb->file = xstrdup((char *)file);
+	}
+	if (!fbc.dirty)
+		clock_gettime(CLOCK_MONOTONIC, &fbc.dirtied);
+	fbc.dirty = 1;
+}
+
+/*
+ * Writes the cache file anew if anything was added to it. This happens
+ * FBCSAVEDELAY after the first new entry, at exit and when the fonts
+ * change, not once per rune found.
+ */
+void
+fbcsave(void)
+{
+	char tmp[PATH_MAX], dir[PATH_MAX];
+	FILE *fp;
+	int i;
+
+	if (!fbc.path || !fbc.dirty)
+		return;
+	fbc.dirty = 0;
+
+	/* create $XDG_CACHE_HOME and stgl below it if needed */
+	snprintf(dir, sizeof(dir), "%s", fbc.path);
+	mkdir(dirname(dirname(dir)), 0700);
+	snprintf(dir, sizeof(dir), "%s", fbc.path);
+	mkdir(dirname(dir), 0700);
 
-	/* Render underline and strikethrough. */
-	if (base.mode & ATTR_UNDERLINE) {
-    gl_draw_rect(fg, winx, winy + dc.font.ascent + 1, width, 1);
+	snprintf(tmp, sizeof(tmp), "%s.%d", fbc.path, (int)getpid());
+	if (!(fp = fopen(tmp, "w")))
+		return;
+	for (i = 0; i < fbc.len; i++) {
+		fprintf(fp, "%d %u %u %d %s\n", fbc.ent[i].flags,
+				(uint)fbc.ent[i].lo, (uint)fbc.ent[i].hi,
+				fbc.ent[i].index, fbc.ent[i].file);
 	}
+	if (fclose(fp) != 0 || rename(tmp, fbc.path) != 0)
+		unlink(tmp);
+}
+
+void
+xdrawglyphfontspecs(struct glyph_spec *specs, Glyph base, int len, int x, int y)
+{
+	int charlen = len * ((base.mode & ATTR_WIDE) ? 2 : 1);
+	struct cell_attr a;
 
-	if (base.mode & ATTR_STRUCK) {
-    gl_draw_rect(fg, winx, winy + 2 * dc.font.ascent / 3, width, 1);
+	/* Fallback on color display for attributes not supported by the font */
+	if (base.mode & ATTR_ITALIC && base.mode & ATTR_BOLD) {
+		if (dc.ibfont.badslant || dc.ibfont.badweight)
+			base.fg = defaultattr;
+	} else if ((base.mode & ATTR_ITALIC && dc.ifont.badslant) ||
+	    (base.mode & ATTR_BOLD && dc.bfont.badweight)) {
+		base.fg = defaultattr;
 	}
+
+	/* Colours are resolved by the renderer, see render_set_palette() */
+	a.fg = base.fg;
+	a.bg = base.bg;
+	a.mode = base.mode;
+
+	/* Backgrounds, underline and strikethrough of the cells */
+	render_cells(dc.rc, &a, x, y, charlen);
+
+	/* Render the glyphs. */
+	render_runes(dc.rc, specs, len, &a);
 }
 
 void
 xdrawglyph(Glyph g, int x, int y)
 {
-	int numspecs;
+	int numspecs = 0, frcflags;
 	struct glyph_spec spec;
+	Font *font = xmodefont(g.mode, &frcflags);
 
-	numspecs = xmakeglyphfontspecs(&spec, &g, 1, x, y);
+	/*
+	 * The cursor and the cells it leaves have colours of their own, they
+	 * are drawn from g and not interned as a terminal style.
+	 */
+	if ((g.mode & ATTR_LAYOUT) != ATTR_WDUMMY) {
+		spec.dirty = tdirtycount(y) < (term.row - 1) && ISDIRTY(y, x);
+		spec.glyph = xglyphlookup(g.u, font, frcflags, &spec.font);
+		spec.x = (short)(borderpx + x * win.cw);
+		spec.y = (short)(borderpx + y * win.ch + font->ascent);
+		numspecs = 1;
+	}
 	xdrawglyphfontspecs(&spec, g, numspecs, x, y);
 }
 
@@ -1336,13 +1937,13 @@ xdrawcursor(void)
 		curx--;
 
 	/* remove the old cursor */
-	og = term.line[oldy][oldx];
+	og = cellglyph(term.line[oldy][oldx]);
 	if (ena_sel && selected(oldx, oldy))
 		og.mode ^= ATTR_REVERSE;
 	xdrawglyph(og, oldx, oldy);
 
 	g.u = term.line[term.c.y][term.c.x].u;
-	g.mode |= term.line[term.c.y][term.c.x].mode &
+	g.mode |= CELLMODE(term.line[term.c.y][term.c.x]) &
 	          (ATTR_BOLD | ATTR_ITALIC | ATTR_UNDERLINE | ATTR_STRUCK);
 
 	/*
@@ -1442,21 +2043,95 @@ xsettitle(char *p)
 void
 draw(void)
 {
+	frctrim();
 	drawregion(0, 0, term.col, term.row);
 }
 
+/*
+ * Hash of everything deciding the geometry of row y: its cells with
+ * their resolved style and the selected columns. The palette, reverse
+ * video and the blink phase are applied by the renderer. Never 0, which
+ * marks a row that was not rendered yet.
+ */
+uint64_t
+xrowhash(int y, int rowsel, int sx1, int sx2)
+{
+	uint64_t h = dc.rowgen;
+	Cell *c;
+	Style *s;
+	int x;
+
+#define ROWHASH(v)	(h = (h ^ (uint64_t)(v)) * 0x9e3779b97f4a7c15ULL, \
+			 h ^= h >> 29)
+	for (x = 0; x < term.col; x++) {
+		c = &term.line[y][x];
+		s = &term.styles[c->style];
+		ROWHASH(c->u);
+		ROWHASH((uint64_t)(s->mode | c->mode) << 32 | s->fg);
+		ROWHASH(s->bg);
+	}
+	if (rowsel)
+		ROWHASH((uint64_t)sx1 << 32 | (uint)sx2);
+#undef ROWHASH
+
+	return h | 1;
+}
+
+/*
+ * The renderer keeps the geometry of every row of both screens, so only
+ * rows whose hash differs from the last rendered one are drawn again.
+ * Rows are always redrawn across their full width.
+ */
 void
 drawregion(int x1, int y1, int x2, int y2)
 {
-	int i, x, y, ox, numspecs;
-	Glyph base, new;
+	int i, x, y, ox, numspecs, runsel, newsel, rowsel, sx1, sx2;
+	int alt = IS_SET(MODE_ALTSCREEN);
+	uint64_t h, *rowhash;
+	Glyph base;
+	Cell run, new;
 	struct glyph_spec *specs;
-	int ena_sel = sel.ob.x != -1 && sel.alt == IS_SET(MODE_ALTSCREEN);
+	struct cell_metrics m = {
+		.x = borderpx, .y = borderpx, .w = win.cw, .h = win.ch,
+		.baseline = dc.font.ascent,
+		.underline = dc.font.ascent + 1,
+		.strike = 2 * dc.font.ascent / 3,
+	};
+	int ena_sel = sel.ob.x != -1 && sel.alt == IS_SET(MODE_ALTSCREEN) &&
+	              sel.mode != SEL_EMPTY;
 
 	if (!(win.state & WIN_VISIBLE))
 		return;
 
+	/* a grid of a new size starts out empty, every row is drawn again */
+	if (dc.gridrows != term.row || dc.gridcols != term.col) {
+		for (i = 0; i < 2; i++) {
+			dc.rowhash[i] = xrealloc(dc.rowhash[i],
+					term.row * sizeof(*dc.rowhash[i]));
+			memset(dc.rowhash[i], 0,
+					term.row * sizeof(*dc.rowhash[i]));
+		}
+		dc.gridrows = term.row;
+		dc.gridcols = term.col;
+	}
+	render_set_grid(dc.rc, term.col, term.row, &m);
+	/* both screens keep their rows, so only what changed is drawn */
+	render_set_screen(dc.rc, alt);
+	render_set_modes(dc.rc, (IS_SET(MODE_REVERSE) ? RENDER_REVERSE : 0) |
+			(IS_SET(MODE_BLINK) ? RENDER_BLINK : 0));
+	rowhash = dc.rowhash[alt];
+
 	for (y = y1; y < y2; y++) {
+		rowsel = ena_sel && selspan(y, &sx1, &sx2);
+		h = xrowhash(y, rowsel, sx1, sx2);
+		if (h == rowhash[y]) {
+			if (term.dirtyrows[y / 64] >> (y % 64) & 1)
+				tcleandirt(y);
+			continue;
+		}
+		rowhash[y] = h;
+		render_begin_row(dc.rc, y);
+
 		specs = dc.specbuf;
 		numspecs = xmakeglyphfontspecs(specs, &term.line[y][x1], x2 - x1, x1, y);
 
@@ -1465,9 +2140,8 @@ drawregion(int x1, int y1, int x2, int y2)
 			new = term.line[y][x];
 			if (new.mode == ATTR_WDUMMY)
 				continue;
-			if (ena_sel && selected(x, y))
-				new.mode ^= ATTR_REVERSE;
-			if (i > 0 && ATTRCMP(base, new)) {
+			newsel = rowsel && BETWEEN(x, sx1, sx2);
+			if (i > 0 && (ATTRCMP(run, new) || runsel != newsel)) {
 				xdrawglyphfontspecs(specs, base, i, ox, y);
 				specs += i;
 				numspecs -= i;
@@ -1475,20 +2149,24 @@ drawregion(int x1, int y1, int x2, int y2)
 			}
 			if (i == 0) {
 				ox = x;
-				base = new;
+				run = new;
+				runsel = newsel;
+				base = cellglyph(new);
+				if (newsel)
+					base.mode ^= ATTR_REVERSE;
 			}
 			i++;
 		}
 		if (i > 0)
 			xdrawglyphfontspecs(specs, base, i, ox, y);
 
-    term.per_row_dirty[y] = 0;
+		if (term.dirtyrows[y / 64] >> (y % 64) & 1)
+			tcleandirt(y);
 	}
+	render_begin_overlay(dc.rc);
 	xdrawcursor();
 
   render_do_render(dc.rc);
-
-  term.dirty_this_frame = 0;
 }
 
 void
@@ -1630,23 +2308,58 @@ cmessage(XEvent *e)
 	} else if (e->xclient.data.l[0] == xw.wmdeletewin) {
 		/* Send SIGHUP to shell */
 		kill(pid, SIGHUP);
-		exit(0);
+		xexit();
 	}
 }
 
+/*
+ * Exits once the shell is done or the window closed, writing the
+ * fallback cache out first.
+ */
+void
+xexit(void)
+{
+	fbcsave();
+	if (getenv("STGL_FRCSTATS"))
+		frcstats();
+	exit(0);
+}
+
 void
 resize(XEvent *e)
 {
-	if (e->xconfigure.width == win.w && e->xconfigure.height == win.h)
+	int w = e->xconfigure.width;
+	int h = e->xconfigure.height;
+
+	if (!rsz.pending && w == win.w && h == win.h)
 		return;
 
-  int w = e->xconfigure.width;
-  int h = e->xconfigure.height;
+	/* applied by xresizesettle() before the next frame is drawn */
+	rsz.w = w;
+	rsz.h = h;
+	rsz.pending = 1;
+}
 
-	cresize(w, h);
-	ttyresize();
+void
+xresizesettle(struct timespec now)
+{
+	int col = term.col, row = term.row;
+
+	if (rsz.pending) {
+		rsz.pending = 0;
+		cresize(rsz.w, rsz.h);
+		render_resize(dc.rc, win.w, win.h);
+		if (term.col != col || term.row != row) {
+			rsz.tty = 1;
+			rsz.last = now;
+		}
+	}
 
-  render_resize(dc.rc, w, h);
+	/* the child only hears of it once the grid settles */
+	if (rsz.tty && TIMEDIFF(now, rsz.last) >= resizetimeout) {
+		rsz.tty = 0;
+		ttyresize();
+	}
 }
 
 void
@@ -1656,7 +2369,9 @@ run(void)
 	int w = win.w, h = win.h;
 	fd_set rfd;
 	int xfd = XConnectionNumber(xw.dpy), xev, blinkset = 0, dodraw = 0;
+	int anim = 0;
 	struct timespec drawtimeout, *tv = NULL, now, last, lastblink;
+	struct timespec tstart, tgl, trender, tfonts;
 	long deltatime;
 
 	/* Waiting for window mapping */
@@ -1674,6 +2389,7 @@ run(void)
 			h = ev.xconfigure.height;
 		}
 	} while (ev.type != MapNotify);
+	clock_gettime(CLOCK_MONOTONIC, &tstart);
 
   // Create the GL context
   {
@@ -1694,16 +2410,21 @@ run(void)
   }
   printf("OpenGL %s, GLSL %s\n", glGetString(GL_VERSION),
          glGetString(GL_SHADING_LANGUAGE_VERSION));
+	clock_gettime(CLOCK_MONOTONIC, &tgl);
   dc.rc = render_init();
-  {
-    struct color c;
-    convert_color(&(dc.col + defaultbg)->color, &c);
-    render_set_clear_color(dc.rc, &c);
-  }
+  xloadpalette();
   render_resize(dc.rc, w, h);
+	clock_gettime(CLOCK_MONOTONIC, &trender);
 
+	fbwinit();
 	usedfont = (opt_font == NULL)? font : opt_font;
 	xloadfonts(usedfont, 0);
+	clock_gettime(CLOCK_MONOTONIC, &tfonts);
+	if (getenv("STGL_STARTUP_TIMING")) {
+		printf("Startup: GL context %.1f ms, renderer %.1f ms, "
+		       "fonts %.1f ms\n", TIMEDIFF(tgl, tstart),
+		       TIMEDIFF(trender, tgl), TIMEDIFF(tfonts, trender));
+	}
 
 	cresize(w, h);
 	ttynew();
@@ -1713,11 +2434,16 @@ run(void)
 	lastblink = last;
 
 	for (xev = actionfps;;) {
+		if (ttyexited())
+			xexit();
+
 		FD_ZERO(&rfd);
 		FD_SET(cmdfd, &rfd);
 		FD_SET(xfd, &rfd);
+		FD_SET(fbw.pipe[0], &rfd);
 
-		if (pselect(MAX(xfd, cmdfd)+1, &rfd, NULL, NULL, tv, NULL) < 0) {
+		if (pselect(MAX(MAX(xfd, cmdfd), fbw.pipe[0])+1, &rfd, NULL, NULL,
+		            tv, NULL) < 0) {
 			if (errno == EINTR)
 				continue;
 			die("select failed: %s\n", strerror(errno));
@@ -1734,7 +2460,14 @@ run(void)
 		if (FD_ISSET(xfd, &rfd))
 			xev = actionfps;
 
+		if (FD_ISSET(fbw.pipe[0], &rfd)) {
+			xfallbackdone();
+			xev = actionfps;
+		}
+
 		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (fbc.dirty && TIMEDIFF(now, fbc.dirtied) >= FBCSAVEDELAY)
+			fbcsave();
 		drawtimeout.tv_sec = 0;
 		drawtimeout.tv_nsec =  (1000 * 1E6)/ xfps;
 		tv = &drawtimeout;
@@ -1747,7 +2480,8 @@ run(void)
 			dodraw = 1;
 		}
 		deltatime = TIMEDIFF(now, last);
-		if (deltatime > 1000 / (xev ? xfps : actionfps)) {
+		if (deltatime > 1000 / (xev || anim || rsz.tty ?
+		                      xfps : actionfps)) {
 			dodraw = 1;
 			last = now;
 		}
@@ -1760,16 +2494,18 @@ run(void)
 				if (handler[ev.type])
 					(handler[ev.type])(&ev);
 			}
+			xresizesettle(now);
 
-      glClearColor(0, 0, 0, 0);
-      glClear(GL_COLOR_BUFFER_BIT);
       draw();
 
       glXSwapBuffers(xw.dpy, xw.win);
+			anim = render_animating(dc.rc);
 
 			if (xev && !FD_ISSET(xfd, &rfd))
 				xev--;
-			if (!FD_ISSET(cmdfd, &rfd) && !FD_ISSET(xfd, &rfd)) {
+			/* effects and resizes keep the frame timeout until they settle */
+			if (!FD_ISSET(cmdfd, &rfd) && !FD_ISSET(xfd, &rfd) && !anim &&
+			    !rsz.tty) {
 				if (blinkset) {
 					if (TIMEDIFF(now, lastblink) \
 							> blinktimeout) {
@@ -1783,6 +2519,14 @@ run(void)
 					drawtimeout.tv_sec = \
 					    drawtimeout.tv_nsec / 1E9;
 					drawtimeout.tv_nsec %= (long)1E9;
+				} else if (fbc.dirty) {
+					/* wake up for the cache save */
+					drawtimeout.tv_nsec = 1E6 * MAX(0,
+						FBCSAVEDELAY - TIMEDIFF(now,
+							fbc.dirtied));
+					drawtimeout.tv_sec = \
+					    drawtimeout.tv_nsec / 1E9;
+					drawtimeout.tv_nsec %= (long)1E9;
 				} else {
 					tv = NULL;
 				}
@@ -1873,22 +2617,6 @@ static void gl_draw_rect(Color * col, int x, int y, int w, int h) {
   render_rect(dc.rc, &tmpc, x, y, w, h);
 }
 
-static void gl_draw_glyph(Color * col, struct glyph_spec * spec) {
-  struct color tmpc;
-  convert_color(&col->color, &tmpc);
-  spec->c = &tmpc;
-  render_rune(dc.rc, spec);
-}
-
-static void gl_draw_glyphs(Color * col, struct glyph_spec * specs, int len) {
-  struct color tmpc;
-  convert_color(&col->color, &tmpc);
-  for (int i = 0; i < len; ++i) {
-    specs[i].c = &tmpc;
-    render_rune(dc.rc, specs + i);
-  }
-}
-
 static float srgb_to_lin(float v) {
   if (v < 0.04045) {
     return v / 12.92;